@@ -185,6 +185,7 @@ gpp [$dp$$bra$o$pipe$O$ket$ $I{outfile}$] [$dp$I$I{/include/path}$ ...]
     [$dp$c $I{str1}$] [$dp$$dp$nostdinc] [$dp$$dp$nocurinc]
     [$dp$$dp$curdirinclast] [$dp$$dp$warninglevel $I{n}$]
     [$dp$$dp$includemarker $I{str}$] [$dp$$dp$include $I{file}$]
+    [$dp$$dp$flush $I{policy}$] [$dp$$dp$includecache $I{n}$] [$dp$$dp$stats]
     [$I{infile}$]
 
 gpp $dp$$dp$help
@@ -480,6 +481,32 @@ is specified in default, cpp or Prolog mode, GPP does its best to
 ensure that line numbers are the same in the output as in the input by
 inserting blank lines in the place of definitions or comments.
 $li$
+$BI{$d$$d$flush }{policy}$
+Set when buffered output is written out: $I{block}$ (whenever the output
+buffer is full), $I{line}$ (after every line), or $I{immediate}$ (after
+every piece of output). The default is $I{line}$ when the output goes to
+a terminal and $I{block}$ otherwise.
+$li$
+$BI{$d$$d$includecache }{n}$
+Keep up to $I{n}$ kilobytes of included files in memory, so that a file
+included again is not read again unless it has changed in the meantime.
+For a file included more than once, the places where macros may be called
+in it are kept as well, for each mode it is included in, and count
+towards the same total. The least recently included files are dropped
+first. The default is 32768; 0 turns this off.
+$li$
+$BI{$d$$d$stats}$
+Print on standard error, once done, how often the results of $I{$dz$if}$
+and $I{$dz$elif}$ conditions could be reused. A result is reused when the
+same condition text comes again in the same mode and none of the macros
+its evaluation looked up has been defined or undefined since. The count
+of include file lookups answered without searching the include
+directories again is printed as well, and that of includes skipped
+because of $I{$dz$once}$ or an include guard, how often included
+files were found in memory, how many includes only made again the
+definitions of the previous time, and how often the places of macro calls
+in an included file were found already known.
+$li$
 $BI{infile}$
 Specify an input file from which GPP reads its input. If no input
 file is specified, input is read from standard input.
@@ -729,11 +756,16 @@ enable recognition of C strings ($dbq$$ldots$$dbq$) and prevent any evaluation
 inside them, so no interference of the characters being put in the C
 string arguments to $I{$dz$mode}$ with the current syntax is to be feared.
 $P$
-On the other hand, the arguments to a user macro are systematically
-evaluated, and then passed as context parameters to the macro definition
-body, which gets evaluated with that environment. The only exception is
-when the macro definition is empty, in which case its arguments are not
-evaluated. Note that GPP temporarily switches back to the mode in which
+On the other hand, the arguments to a user macro are evaluated and passed
+as context parameters to the macro definition body, which gets evaluated
+with that environment. An argument is evaluated, in the mode and context
+of the call, the first time the body refers to it, and the result is
+reused for later references; arguments that the body never refers to are
+not evaluated at all (in particular, when the macro definition is empty).
+This does not change the result: an argument that may call a meta-macro,
+directly or through the macros it calls, is evaluated at the time of the
+call, and the arguments still waiting are evaluated before the body calls
+a meta-macro or a macro that may. Note that GPP temporarily switches back to the mode in which
 the macro was defined in order to evaluate it, so it is perfectly safe
 to change the operating mode between the time a macro is defined
 and the time when it is called. Conversely, if a user macro wishes to
@@ -858,12 +890,26 @@ a $I{$dz$mode restore}$ call and ending with a $I{$dz$mode push}$ call.
 Additionally, when the $I{$d$m}$ command line option is specified, GPP will
 automatically switch to the cpp compatibility mode upon including a file
 whose name ends with either `.c' or `.h'.
+$p$
+A file that only defines and undefines macros, and outputs nothing but
+blank lines, is not read again when it is included once more in the same
+mode, as long as it is unchanged and the macros it tested or expanded
+before defining them still have the same definitions: GPP makes its
+definitions again directly.
 $li$
 $BI{$dz$sinclude }{file}$
 This is a $Q{silent}$ version of the $I{$dz$include}$ meta-macro that does
 not emit an error in the event that the specified file does not exist or
 cannot be opened.
 $li$
+$BI{$dz$once}$
+This marks the file that contains it as one to be included only once:
+any later $I{$dz$include}$ of the same file does nothing, even when
+its path is written another way. Files whose
+whole content lies between $I{$dz$ifndef}$ $I{x}$ and the matching
+$I{$dz$endif}$ get the same treatment without it, as long as $I{x}$ is
+defined and the mode is the same.
+$li$
 $BI{$dz$exec }{command}$
 This causes GPP to execute the specified command line and include its standard
 output in the current output. Note that, for security reasons, this meta-macro
@@ -881,7 +927,10 @@ expanding macros (normal GPP evaluation) and then by performing
 arithmetic evaluation and$bs$or wildcard matching.  The syntax and
 operator precedence for arithmetic expressions are the same as in C;
 the only missing operators are $l$$l$, $g$$g$, ?:, and the assignment
-operators.
+operators. Computations are done on 64-bit integers.
+As in C, the right operand of $pipe$$pipe$ or $and$$and$ is not evaluated
+when the left one decides the result; when these operators appear
+outside of parentheses, such an operand is not even macro-expanded.
 $p$
 POSIX-style wildcard matching (`globbing') is available only on POSIX
 implementations and can be invoked with the =$tilde$ operator.  In
@@ -901,7 +950,7 @@ instead (ignoring trailing and leading spaces).  Additionally, the
 $I{length($ldots$)}$ arithmetic operator returns the length in
 characters of its evaluated argument.
 $p$
-Inside arithmetic expressions, the $I{defined($ldots$)}$ special user macro
+Inside arithmetic expressions, the $I{defined($ldots$)}$ operator
 is also available: it takes only one argument, which is not evaluated, and
 returns 1 if it is the name of a user macro and 0 otherwise.
 $li$
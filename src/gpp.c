@@ -25,6 +25,7 @@
 #endif
 
 #ifdef WIN_NT              /* WIN NT settings */
+#include <io.h>
 #define popen   _popen
 #define pclose  _pclose
 #define my_strdup  _strdup
@@ -44,14 +45,85 @@
 #  include <fnmatch.h>
 #endif
 #include <time.h>
+#include <fcntl.h>
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(S_ISREG) && defined(S_IFMT) && defined(S_IFREG)
+#  define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+#  include <sys/mman.h>
+#  define USE_MMAP 1
+#  if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#    define MAP_ANONYMOUS MAP_ANON
+#  endif
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+#  include <emmintrin.h>
+#endif
 
 #define STACKDEPTH 50
 #define MAXARGS 100
 #define MAXINCL 128   /* max # of include dirs */
 
-#define MAX_GPP_NUM_SIZE 15
+#define INPUT_BLOCK_SIZE 65536  /* bytes per read(2) on input files */
+#define FILECACHE_SIZE 32768    /* default KB of include files kept */
+#define OUTPUT_BLOCK_SIZE 65536 /* bytes per write(2) on the output */
+
+#define MAX_GPP_NUM_SIZE 24
 #define MAX_GPP_DATE_SIZE 1024
 
+/* a delimiter string compiled for matching : each special char becomes
+   an op testing the next chars against a class, see compileSeq() */
+#define MOP_CHAR   0 /* this very char */
+#define MOP_CLASS  1 /* one char in the class, or out of it if neg */
+#define MOP_STAR   2 /* any number of chars in the class */
+#define MOP_NOTRUN 3 /* one char out of the class ; a run of them fails */
+#define MOP_FAIL   4
+#define MOP_NONE   5 /* (context only) nothing to check */
+
+/* flags of a char in the chars[] table of the specs ; the first ones
+   are fixed, see charclass[], the others depend on the specs */
+#define CH_ALPHA   0x0001
+#define CH_DIGIT   0x0002
+#define CH_BLANK   0x0004 /* space or tab */
+#define CH_TAB     0x0008
+#define CH_NL      0x0010
+#define CH_WORD    0x0020 /* part of an identifier, see isDelim() */
+#define CH_ID      0x0040 /* #mode charset id */
+#define CH_OP      0x0080 /* #mode charset op */
+#define CH_OPX     0x0100 /* #mode charset par */
+#define CH_STACK   0x0200 /* User.stackchar */
+#define CH_UNSTACK 0x0400
+#define CH_MSTACK  0x0800 /* Meta.stackchar */
+#define CH_MUNSTACK 0x1000
+#define CH_QUOTE   0x2000 /* User.quotechar */
+#define CH_WHITE   (CH_BLANK | CH_NL)
+
+/* the CH_ flags of char c in the current specs */
+#define charFlags(c) (S->chars[(unsigned char) (c)])
+
+typedef struct MATCHOP {
+    unsigned char kind;
+    unsigned char neg;
+    char c; /* the char of MOP_CHAR */
+    unsigned short cls; /* the CH_ flags of the class */
+} MATCHOP;
+
+typedef struct MATCHER {
+    struct MATCHER *next; /* in the intern table */
+    char *s; /* what it was compiled from */
+    struct MATCHOP ctx; /* test on the char before a start sequence */
+    int first; /* ops[first] follows that test */
+    int nops;
+    struct MATCHOP ops[1];
+} MATCHER;
+
 typedef struct MODE {
     char *mStart; /* before macro name */
     char *mEnd; /* end macro without arg */
@@ -62,6 +134,8 @@ typedef struct MODE {
     char quotechar; /* quote next char */
     char *stackchar; /* characters to stack */
     char *unstackchar; /* characters to unstack */
+    /* the delimiters as compiled by compileMode() */
+    struct MATCHER *cStart, *cEnd, *cArgS, *cArgSep, *cArgE, *cArgRef;
 } MODE;
 
 /* translation for delimiters :
@@ -77,30 +151,27 @@ typedef struct MODE {
    \013 = \o = operator (+-*\/^<>=`~:.?@#&!%|) \213 = \!o
    \014 = \O = operator or ()[]{}              \214 = \!O
 */
+/* the matchers are compiled from the strings by compileMode() */
+#define UNCOMPILED NULL, NULL, NULL, NULL, NULL, NULL
+
 /*                   st        end   args   sep    arge ref  quot  stk  unstk*/
-struct MODE CUser = {"",       "",   "(",   ",",   ")", "#", '\\', "(", ")" };
-struct MODE CMeta = {"#",      "\n", "\001","\001","\n","#", '\\', "(", ")" };
-struct MODE KUser = {"",       "",   "(",   ",",   ")", "#",  0,   "(", ")" };
-struct MODE KMeta = {"\n#\002","\n", "\001","\001","\n","#",  0,   "",  ""  }; 
-struct MODE Tex   = {"\\",     "",   "{",   "}{",  "}", "#", '@',  "{", "}" };
-struct MODE Html  = {"<#",     ">",  "\003","|",   ">", "#", '\\', "<", ">" };
-struct MODE XHtml = {"<#",     "/>", "\003","|",   "/>","#", '\\', "<", ">" };
+struct MODE CUser = {"",       "",   "(",   ",",   ")", "#", '\\', "(", ")", UNCOMPILED };
+struct MODE CMeta = {"#",      "\n", "\001","\001","\n","#", '\\', "(", ")", UNCOMPILED };
+struct MODE KUser = {"",       "",   "(",   ",",   ")", "#",  0,   "(", ")", UNCOMPILED };
+struct MODE KMeta = {"\n#\002","\n", "\001","\001","\n","#",  0,   "",  "", UNCOMPILED }; 
+struct MODE Tex   = {"\\",     "",   "{",   "}{",  "}", "#", '@',  "{", "}", UNCOMPILED };
+struct MODE Html  = {"<#",     ">",  "\003","|",   ">", "#", '\\', "<", ">", UNCOMPILED };
+struct MODE XHtml = {"<#",     "/>", "\003","|",   "/>","#", '\\', "<", ">", UNCOMPILED };
 
 #define DEFAULT_OP_STRING (unsigned char *)"+-*/\\^<>=`~:.?@#&!%|"
 #define PROLOG_OP_STRING  (unsigned char *)"+-*/\\^<>=`~:.?@#&"
 #define DEFAULT_OP_PLUS   (unsigned char *)"()[]{}"
 #define DEFAULT_ID_STRING (unsigned char *)"\005\007_" /* or equiv. "A-Za-z0-9_" */
 
-/* here we assume that longs are at least 32 bit... if not, change this ! */
-#define LOG_LONG_BITS 5
-#define CHARSET_SUBSET_LEN (256 >> LOG_LONG_BITS)
-typedef unsigned long *CHARSET_SUBSET;
-
-CHARSET_SUBSET DefaultOp, DefaultExtOp, PrologOp, DefaultId;
-
 typedef struct COMMENT {
     char *start; /* how the comment/string starts */
     char *end; /* how it ends */
+    struct MATCHER *cstart, *cend;
     char quote; /* how to prevent it from ending */
     char warn; /* a character that shouldn't be in there */
     int flags[3]; /* meta, user, text */
@@ -146,25 +217,236 @@ typedef struct COMMENT {
  #ifeq will always fail while #ifneq will always succeed ;
 */ 
 
+/* specs are shared by the mode stack levels and the macros defined
+   under them, and copied before being changed : see writableSpecs() */
 typedef struct SPECS {
+    int refs;
+    unsigned int hash; /* of the contents, see sameSpecs() */
+    struct SPECS *next_live;
     struct MODE User, Meta;
     struct COMMENT *comments;
-    struct SPECS *stack_next;
     int preservelf;
-    CHARSET_SUBSET op_set, ext_op_set, id_set;
+    unsigned short chars[256]; /* CH_ flags of each char */
+    /* comments whose start may match at a given byte : bit k stands for
+       the k-th entry of the list (the last bit for all the following
+       ones) */
+    unsigned int comment_first[256];
+    /* bytes ParseText() may have to act upon at the start of a token,
+       also listed in stopbytes[] when there are few of them */
+    char stop_first[256];
+    char stopbytes[8];
+    int nstopbytes;
+    int stop_word;     /* some identifier char is in stop_first[] */
+    int lookahead;     /* user macro ends may read past the identifier */
+    /* bytes the argument loops of user and meta macro calls go by
+       without acting : identifier chars and uninteresting delimiters */
+    char user_arg_inert[256];
+    char meta_arg_inert[256];
 } SPECS;
 
-struct SPECS *S;
+#define COMMENT_BIT(k) (1u << ((k) < 31 ? (k) : 31))
+
+/* a level of the mode stack */
+typedef struct SPECSTACK {
+    struct SPECS *specs;
+    struct SPECSTACK *next;
+} SPECSTACK;
+
+struct SPECS *S; /* specstack->specs, the current specs */
+struct SPECSTACK *specstack;
+struct SPECS *livespecs; /* all the specs, for hash-consing */
+
+/* a place in a macro body where the scanner has something to do; the
+   text between two of them is output as it is */
+typedef struct BODYSEG {
+    int pos, end; /* in text[] */
+    int kind; /* SEG_SCAN, SEG_ARGREF, SEG_NAMEDARG or SEG_IDENT */
+    int arg; /* for SEG_IDENT, where the name starts */
+} BODYSEG;
+
+#define SEG_SCAN     0 /* comment, meta macro or quote: rescan */
+#define SEG_ARGREF   1 /* #1..#9 */
+#define SEG_NAMEDARG 2
+#define SEG_IDENT    3 /* a user macro call if the name is defined */
+
+/* "\n" + macrotext, segmented against define_specs by compileBody().
+   Expansions read it in place, so it is refcounted: a macro may #undef
+   itself while it is being expanded. */
+typedef struct MACROBODY {
+    int refs;
+    char *text;
+    int len;
+    struct BODYSEG *segs;
+    int nsegs;
+    int constant; /* no arguments, and only SEG_IDENT segments */
+    int checked; /* macrodefs when these were found undefined */
+    int metas; /* may call meta-macros of its own */
+    int quiet; /* runs no meta-macro, as of macrodefs == quietchecked */
+    int quietchecked;
+} MACROBODY;
 
 typedef struct MACRO {
     char *username, *macrotext, **argnames;
     int macrolen, nnamedargs;
+    int namelen;
+    unsigned int hash; /* hash of username, see hashIdent() */
     struct SPECS *define_specs;
     int defined_in_comment;
+    struct MACROBODY *body; /* NULL if the body has to be copied */
 } MACRO;
 
 struct MACRO *macros;
 int nmacros, nalloced;
+
+/* open-addressing index of macros[] by name (linear probing, -1 = free);
+   the size is a power of two, kept at most half full */
+int *macroindex;
+int macroindexsize;
+
+/* number of macro names by identFilterKey(), so that most identifiers
+   can be told not to be macros without being hashed */
+#define IDENT_FILTER_SIZE 4096
+unsigned int identfilter[IDENT_FILTER_SIZE];
+
+/* while #if expressions are expanded, defined(...) is an operator that
+   findIdent() does not know about : isDefinedOp() tells it apart */
+int definedop;
+#define DEFINED_OP -2
+
+/* results of #if/#elif conditions, kept as long as none of the names
+   their expansion looked up gets defined or undefined : identgen[] counts
+   these changes by identFilterKey() */
+unsigned int identgen[IDENT_FILTER_SIZE];
+
+#define IFCACHE_SIZE 1024
+#define IFCACHE_CHAIN 8 /* entries per bucket, the least recently used go */
+#define IFCACHE_DEPS 32
+
+typedef struct IFDEPS {
+    int n; /* -1 if the result cannot be kept */
+    unsigned short key[IFCACHE_DEPS];
+    unsigned int gen[IFCACHE_DEPS];
+} IFDEPS;
+
+typedef struct IFCACHE {
+    char *text;
+    int len;
+    struct SPECS *specs;
+    int result;
+    struct IFDEPS deps;
+    struct IFCACHE *next;
+} IFCACHE;
+
+struct IFCACHE *ifcache[IFCACHE_SIZE];
+struct IFDEPS *ifdeps; /* where lookups are being noted, if anywhere */
+int metacalls; /* bumped by every meta-macro */
+unsigned long ifhits, ifmisses;
+
+/* where #include found a name, from the directory of the including file ;
+   path is NULL if it was not found at all */
+#define INCCACHE_SIZE 256
+
+typedef struct INCCACHE {
+    char *dir; /* SLASH-terminated, or "" */
+    char *name;
+    char *path;
+    int searched;
+    int known; /* dev and ino of path were found when it was opened */
+    dev_t dev;
+    ino_t ino;
+    char *canon; /* path in a single spelling, where they were not */
+    struct INCCACHE *next;
+} INCCACHE;
+
+struct INCCACHE *inccache[INCCACHE_SIZE];
+unsigned long inchits, incmisses;
+
+/* what an included file does once its guard macro is defined : print the
+   blanks around the guard, which is all that may lie outside of it.  A
+   file that said #once does nothing at all */
+#define GUARD_OUT_MAX 256
+
+typedef struct INCGUARD {
+    char *path; /* if not known by dev and ino */
+    int known;
+    dev_t dev;
+    ino_t ino;
+    int once;
+    char *macro; /* NULL until a guard is seen */
+    struct SPECS *specs; /* of the including context */
+    char *out;
+    int outlen;
+    struct REPLAY *replay; /* what it did to the macros, or NULL */
+    struct INCGUARD *next;
+} INCGUARD;
+
+/* an include in progress, looked at for a guard */
+typedef struct GUARDWATCH {
+    struct INCGUARD *G;
+    struct INPUTCONTEXT *ctx;
+    struct SPECS *specs;
+    int state; /* 0 before the guard, 1 inside, 2 after, -1 no guard */
+    int level, metas, macros, execs;
+    char *macro;
+    char out[GUARD_OUT_MAX];
+    int outlen;
+} GUARDWATCH;
+
+struct INCGUARD *incguards[INCCACHE_SIZE];
+struct GUARDWATCH *watch;
+struct GUARDWATCH *capture; /* watch, while output goes around the guard */
+int macrocalls; /* bumped by every user macro call */
+int execs; /* bumped by every #exec, which may change files */
+unsigned long guardskips;
+
+/* what including a file did that can be done again without reading it :
+   define and undefine names, and print blanks.  It holds as long as the
+   files are the same, and the names the file looked up before touching
+   them still stand for what they did, see replayHolds() */
+#define REPLAY_NAMES 1024
+#define REPLAY_OUT_MAX 65536
+
+#define NAME_LOOKED  1 /* before holds what the name stood for */
+#define NAME_TOUCHED 2 /* after holds what the file left it as */
+
+typedef struct REPLAYNAME {
+    char *name;
+    int len;
+    unsigned int hash;
+    int flags;
+    struct MACRO *before, *after; /* NULL if undefined */
+} REPLAYNAME;
+
+typedef struct FILESIG {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+} FILESIG;
+
+typedef struct REPLAY {
+    char *filename;
+    struct SPECS *specs; /* of the including context */
+    struct REPLAYNAME *names;
+    int nnames, namesalloced;
+    struct FILESIG *files; /* the file, and all it included */
+    int nfiles, filesalloced;
+    char *out;
+    int outlen, outalloced;
+    /* while the file is being recorded */
+    int valid;
+    struct INPUTCONTEXT *ctx;
+    struct SPECSTACK *base; /* the level under that of the file */
+    struct SPECS *basespecs;
+    int level, execs;
+    struct REPLAY *outer;
+} REPLAY;
+
+struct REPLAY *recording; /* innermost include being recorded */
+int recordings; /* the valid ones in the chain */
+unsigned long replays;
+int showstats;
 char *includedir[MAXINCL];
 int nincludedirs;
 int execallowed;
@@ -186,27 +468,109 @@ int CurDirIncLast = 0;
 int file_and_stdout = 0;
 char *IncludeFile = NULL;
 
+typedef struct OUTPUTFILE {
+    int fd;
+    int teefd; /* stdout as well (-O), or -1 */
+    char *buf, *teebuf;
+    int len, teelen;
+    int flush; /* FLUSH_BLOCK, FLUSH_LINE or FLUSH_NOW */
+} OUTPUTFILE;
+
+#define FLUSH_DEFAULT -1 /* by line on a terminal, by block otherwise */
+#define FLUSH_BLOCK    0
+#define FLUSH_LINE     1
+#define FLUSH_NOW      2
+
+int flushmode = FLUSH_DEFAULT;
+struct OUTPUTFILE *mainoutput;
+
 typedef struct OUTPUTCONTEXT {
     char *buf;
     int len, bufsize;
-    FILE *f;
+    struct OUTPUTFILE *f;
 } OUTPUTCONTEXT;
 
+typedef struct INPUTFILE {
+    int fd;
+    char *block; /* read-ahead, not yet handed to the input context */
+    int blockpos, blocklen;
+    int eof; /* a read past the end was attempted */
+    /* regular files are scanned in place instead: text[-1] is a '\n' and
+       textend[0] a 0, see mapInput() */
+    char *text, *textend;
+    char *region; /* what to munmap() or free() */
+    size_t regionlen; /* 0 if region was malloc-ed */
+    struct FILECACHE *cached; /* owner of the text instead, or NULL */
+    struct TEXTSEGS *segs; /* where plainTextEnd() may stop, or NULL */
+    int seg; /* first of segs not behind the window */
+} INPUTFILE;
+
+/* the places of a cached text where plainTextEnd() may stop under given
+   specs : the bytes of the stop set that it can reach, and identifiers
+   when user macros have no start sequence ; it skips the rest unread */
+typedef struct TEXTSEG {
+    int pos, end; /* offsets in the text ; end == pos for a stop byte */
+} TEXTSEG;
+
+typedef struct TEXTSEGS {
+    struct SPECS *specs;
+    struct TEXTSEG *segs;
+    int nsegs;
+    struct TEXTSEGS *next;
+} TEXTSEGS;
+
+/* the text of included files, as mapInput() left it, by file identity ;
+   the least recently used ones go first once over filecachemax bytes */
+#define FILECACHE_HASH 256
+
+typedef struct FILECACHE {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    char *text, *textend;
+    char *region;
+    size_t regionlen;
+    int refs; /* 1 for the table, plus each open INPUTFILE */
+    int hits;
+    struct TEXTSEGS *segs; /* by specs, built from the second #include on */
+    size_t seglen; /* bytes of segs, counted in filecachelen */
+    struct FILECACHE *next; /* in the hash chain */
+    struct FILECACHE *newer, *older;
+} FILECACHE;
+
+struct FILECACHE *filecache[FILECACHE_HASH];
+struct FILECACHE *newestfile, *oldestfile;
+size_t filecachemax = (size_t) FILECACHE_SIZE * 1024, filecachelen;
+unsigned long filehits, filemisses, segbuilds, segreuses;
+
+typedef struct MACROARGS {
+    int argc;
+    char *argv[MAXARGS]; /* NULL until expanded, see macroArg() */
+    int argl[MAXARGS]; /* argv[] need not be 0-terminated */
+    int argb[MAXARGS], arge[MAXARGS]; /* the text in caller->buf */
+    char expanded[MAXARGS]; /* argv[] was malloc-ed */
+    struct INPUTCONTEXT *caller;
+    struct SPECSTACK *specs; /* current at the call */
+} MACROARGS;
+
 typedef struct INPUTCONTEXT {
     char *buf;
     char *malloced_buf; /* what was actually malloc-ed (buf may have shifted) */
     int len, bufsize;
     int lineno;
     char *filename;
-    FILE *in;
-    int argc;
-    char **argv;
+    struct INPUTFILE *in;
+    struct MACROARGS *args; /* of the macro being expanded, or NULL */
     char **namedargs;
     struct OUTPUTCONTEXT *out;
     int eof;
     int in_comment;
     int ambience; /* FLAG_TEXT, FLAG_USER or FLAG_META */
     int may_have_args;
+    struct MACROBODY *body; /* buf is body->text, see ParseBody() */
+    int bodyseg; /* first segment not behind buf */
+    int bodymodes; /* modechanges when the body was entered */
 } INPUTCONTEXT;
 
 struct INPUTCONTEXT *C;
@@ -217,10 +581,23 @@ int commented[STACKDEPTH], iflevel;
  the right case (so #else/#elif can't toggle back to output) */
 
 int parselevel;
+int modechanges; /* bumped whenever the specs of a context may change */
+int macrodefs; /* bumped by every macro definition */
 
 void ProcessContext(void); /* the main loop */
 
 int findIdent(const char *b, int l);
+int isDefinedOp(const char *b, int l);
+int findNamedArg(const char *b, int l);
+void compileBody(int n);
+void buildSpecsTables(struct SPECS *P);
+unsigned int hashIdent(const char *b, int l);
+struct MATCHER *compileSeq(const char *s);
+void releaseBody(struct MACROBODY *B);
+char *macroArg(int i);
+void settleArgs(struct MACROARGS *A, int n);
+int fileSig(const char *path, struct FILESIG *F);
+void commit_macro(void);
 void delete_macro(int i);
 
 /* various recent additions */
@@ -229,12 +606,18 @@ void display_version(void);
 void bug(const char *s);
 void warning(const char *s);
 static void getDirname(const char *fname, char *dirname);
-static FILE *openInCurrentDir(const char *incfile);
+static struct INPUTFILE *openInCurrentDir(const char *incfile, char **path);
 char *ArithmEval(int pos1, int pos2);
+int evalCondition(int pos1, int pos2);
+void captureOutput(const char *s, int l);
+void noteLookup(const char *b, int l);
+void recordOutput(const char *s, int l);
+void stopRecordings(void);
+void notePop(const struct SPECSTACK *L);
 void replace_definition_with_blank_lines(const char *start, const char *end,
         int skip);
-void replace_directive_with_blank_line(FILE *file);
-void write_include_marker(FILE *f, int lineno, char *filename,
+void replace_directive_with_blank_line(struct OUTPUTFILE *file);
+void write_include_marker(struct OUTPUTFILE *f, int lineno, char *filename,
         const char *marker);
 void construct_include_directive_marker(char **include_directive_marker,
         const char *includemarker_input);
@@ -280,6 +663,88 @@ void bug(const char *s) {
 
 void warning(const char *s) {
     fprintf(stderr, "%s:%d: warning: %s\n", C->filename, C->lineno, s);
+    if (recordings)
+        stopRecordings(); /* a replay would not say it again */
+}
+
+/* scratch memory of nested expansions.  Allocation is a pointer bump in
+   the top chunk; whatever was allocated since an arenaMark() is given
+   back at once by arenaRelease().  Marks nest like the expansions that
+   take them, so nothing allocated here may outlive the enclosing mark. */
+typedef struct ARENACHUNK {
+    struct ARENACHUNK *prev;
+    size_t size, used;
+} ARENACHUNK;
+
+typedef struct ARENAMARK {
+    struct ARENACHUNK *chunk;
+    size_t used;
+} ARENAMARK;
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t) 15)
+#define ARENA_HEADER ARENA_ALIGN(sizeof(struct ARENACHUNK))
+
+struct ARENACHUNK *arena;
+struct ARENACHUNK *sparechunk; /* last chunk released, kept for reuse */
+
+void *arenaAlloc(size_t n) {
+    struct ARENACHUNK *c;
+    size_t size;
+
+    n = ARENA_ALIGN(n);
+    if ((arena == NULL) || (arena->used + n > arena->size)) {
+        size = ARENA_CHUNK_SIZE;
+        while (size < n + ARENA_HEADER)
+            size *= 2;
+        if ((sparechunk != NULL) && (sparechunk->size >= size)) {
+            c = sparechunk;
+            sparechunk = NULL;
+        } else {
+            c = malloc(size);
+            if (c == NULL)
+                bug("Out of memory");
+            c->size = size;
+        }
+        c->used = ARENA_HEADER;
+        c->prev = arena;
+        arena = c;
+    }
+    arena->used += n;
+    return (char *) arena + arena->used - n;
+}
+
+struct ARENAMARK arenaMark(void) {
+    struct ARENAMARK m;
+
+    m.chunk = arena;
+    m.used = (arena != NULL) ? arena->used : 0;
+    return m;
+}
+
+void arenaRelease(struct ARENAMARK m) {
+    struct ARENACHUNK *c;
+
+    while (arena != m.chunk) {
+        c = arena;
+        arena = c->prev;
+        if ((sparechunk == NULL) || (sparechunk->size < c->size)) {
+            free(sparechunk);
+            sparechunk = c;
+        } else
+            free(c);
+    }
+    if (arena != NULL)
+        arena->used = m.used;
+}
+
+/* copy of s living until the enclosing arenaRelease() */
+char *arenaStrdup(const char *s, size_t l) {
+    char *t = arenaAlloc(l + 1);
+
+    memcpy(t, s, l);
+    t[l] = 0;
+    return t;
 }
 
 struct SPECS *CloneSpecs(const struct SPECS *Q) {
@@ -290,7 +755,9 @@ struct SPECS *CloneSpecs(const struct SPECS *Q) {
     if (P == NULL )
         bug("Out of memory.");
     memcpy(P, Q, sizeof(struct SPECS));
-    P->stack_next = NULL;
+    P->refs = 1;
+    P->next_live = livespecs;
+    livespecs = P;
     if (Q->comments != NULL )
         P->comments = malloc(sizeof *(P->comments));
     for (x = Q->comments, y = P->comments; x != NULL ;
@@ -316,23 +783,94 @@ void FreeComments(struct SPECS *Q) {
     }
 }
 
-void PushSpecs(const struct SPECS *X) {
-    struct SPECS *P;
-
-    P = CloneSpecs(X);
-    P->stack_next = S;
-    S = P;
+struct SPECS *shareSpecs(struct SPECS *P) {
+    P->refs++;
+    return P;
 }
 
-void PopSpecs(void) {
-    struct SPECS *P;
+void releaseSpecs(struct SPECS *P) {
+    struct SPECS **q;
 
-    P = S;
-    S = P->stack_next;
+    if ((P == NULL) || (--P->refs > 0))
+        return;
+    for (q = &livespecs; *q != P; q = &(*q)->next_live)
+        ;
+    *q = P->next_live;
     FreeComments(P);
     free(P);
-    if (S == NULL )
+}
+
+int sameMode(const struct MODE *M, const struct MODE *N) {
+    return !strcmp(M->mStart, N->mStart) && !strcmp(M->mEnd, N->mEnd)
+            && !strcmp(M->mArgS, N->mArgS) && !strcmp(M->mArgSep, N->mArgSep)
+            && !strcmp(M->mArgE, N->mArgE) && !strcmp(M->mArgRef, N->mArgRef)
+            && (M->quotechar == N->quotechar)
+            && !strcmp(M->stackchar, N->stackchar)
+            && !strcmp(M->unstackchar, N->unstackchar);
+}
+
+int sameSpecs(const struct SPECS *P, const struct SPECS *Q) {
+    struct COMMENT *x, *y;
+
+    if (!sameMode(&P->User, &Q->User) || !sameMode(&P->Meta, &Q->Meta)
+            || (P->preservelf != Q->preservelf)
+            || memcmp(P->chars, Q->chars, sizeof P->chars))
+        return 0;
+    for (x = P->comments, y = Q->comments; (x != NULL) && (y != NULL);
+            x = x->next, y = y->next)
+        if (strcmp(x->start, y->start) || strcmp(x->end, y->end)
+                || (x->quote != y->quote) || (x->warn != y->warn)
+                || memcmp(x->flags, y->flags, sizeof x->flags))
+            return 0;
+    return (x == NULL) && (y == NULL);
+}
+
+/* specs equal to P that already exist, or P itself */
+struct SPECS *internSpecs(struct SPECS *P) {
+    struct SPECS *Q;
+
+    for (Q = livespecs; Q != NULL; Q = Q->next_live)
+        if ((Q != P) && (Q->hash == P->hash) && sameSpecs(P, Q)) {
+            Q->refs++;
+            releaseSpecs(P);
+            return Q;
+        }
+    return P;
+}
+
+/* the specs of stack level L, made its own so that they can be changed */
+struct SPECS *writableSpecs(struct SPECSTACK *L) {
+    if (L->specs->refs > 1) {
+        L->specs->refs--;
+        L->specs = CloneSpecs(L->specs);
+        if (L == specstack)
+            S = L->specs;
+    }
+    return L->specs;
+}
+
+void PushSpecs(struct SPECS *X) {
+    struct SPECSTACK *L;
+
+    L = malloc(sizeof *L);
+    if (L == NULL )
+        bug("Out of memory.");
+    L->specs = shareSpecs(X);
+    L->next = specstack;
+    specstack = L;
+    S = X;
+}
+
+void PopSpecs(void) {
+    struct SPECSTACK *L;
+
+    L = specstack;
+    specstack = L->next;
+    releaseSpecs(L->specs);
+    free(L);
+    if (specstack == NULL )
         bug("#mode restore without #mode save");
+    S = specstack->specs;
 }
 
 void display_version(void) {
@@ -369,33 +907,39 @@ void usage(void) {
     printf(" --nocurinc : don't search the current directory for files to include\n");
     printf(" --curdirinclast : search the current directory last\n");
     printf(" --warninglevel n : set warning level\n");
-    printf(" --includemarker formatstring : keep track of #include directives in output\n\n");
+    printf(" --includemarker formatstring : keep track of #include directives in output\n");
+    printf(" --flush block|line|immediate : when to write out buffered output\n");
+    printf(" --includecache n : keep up to n KB of included files in memory\n");
+    printf(" --stats : report cache use on stderr when done\n\n");
     printf(" --version : display version information and exit\n");
     printf(" -h, --help : display this message and exit\n\n");
 }
 
+/* fixed flags of each char, see CH_ALPHA */
+unsigned short charclass[256];
+
+void initCharClasses(void) {
+    int c;
+
+    memset(charclass, 0, sizeof charclass);
+    for (c = 'a'; c <= 'z'; c++)
+        charclass[c] = charclass[c - 'a' + 'A'] = CH_ALPHA | CH_WORD;
+    for (c = '0'; c <= '9'; c++)
+        charclass[c] = CH_DIGIT | CH_WORD;
+    for (c = 128; c < 256; c++)
+        charclass[c] = CH_WORD;
+    charclass['_'] = CH_WORD;
+    charclass[' '] = CH_BLANK;
+    charclass['\t'] = CH_BLANK | CH_TAB;
+    charclass['\n'] = CH_NL;
+}
+
 int isDelim(unsigned char c) {
-    if (c >= 128)
-        return 0;
-    if ((c >= '0') && (c <= '9'))
-        return 0;
-    if ((c >= 'A') && (c <= 'Z'))
-        return 0;
-    if ((c >= 'a') && (c <= 'z'))
-        return 0;
-    if (c == '_')
-        return 0;
-    return 1;
+    return !(charclass[c] & CH_WORD);
 }
 
 int isWhite(char c) {
-    if (c == ' ')
-        return 1;
-    if (c == '\t')
-        return 1;
-    if (c == '\n')
-        return 1;
-    return 0;
+    return (charclass[(unsigned char) c] & CH_WHITE) != 0;
 }
 
 void newmacro(const char *s, int len, int hasspecs) {
@@ -408,11 +952,13 @@ void newmacro(const char *s, int len, int hasspecs) {
     macros[nmacros].username = malloc(len + 1);
     strncpy(macros[nmacros].username, s, len);
     macros[nmacros].username[len] = 0;
+    macros[nmacros].namelen = len;
     macros[nmacros].argnames = NULL;
     macros[nmacros].nnamedargs = 0;
     macros[nmacros].defined_in_comment = 0;
+    macros[nmacros].body = NULL;
     if (hasspecs)
-        macros[nmacros].define_specs = CloneSpecs(S);
+        macros[nmacros].define_specs = shareSpecs(S);
     else
         macros[nmacros].define_specs = NULL;
 }
@@ -674,7 +1220,8 @@ void parseCmdlineDefine(const char *s) {
     else if (s[l] != 0)
         bug("invalid syntax in -D declaration");
     macros[nmacros].macrolen = strlen(s + l);
-    macros[nmacros++].macrotext = my_strdup(s + l);
+    macros[nmacros].macrotext = my_strdup(s + l);
+    commit_macro();
 }
 
 int readModeDescription(char **args, struct MODE *mode, int ismeta) {
@@ -762,6 +1309,9 @@ void add_comment(struct SPECS *S, const char *specif, char *start, char *end,
     p->flags[FLAG_META] = parse_comment_specif(specif[0]);
     p->flags[FLAG_USER] = parse_comment_specif(specif[1]);
     p->flags[FLAG_TEXT] = parse_comment_specif(specif[2]);
+    p->cstart = compileSeq(start);
+    p->cend = compileSeq(end);
+    buildSpecsTables(S);
 }
 
 void delete_comment(struct SPECS *S, char *start) {
@@ -778,6 +1328,7 @@ void delete_comment(struct SPECS *S, char *start) {
             free(p->end);
             free(p);
             free(start);
+            buildSpecsTables(S);
             return;
         } else
             q = p;
@@ -785,88 +1336,659 @@ void delete_comment(struct SPECS *S, char *start) {
     free(start);
 }
 
-void outchar(char c) {
+struct OUTPUTFILE *openOutputFd(int fd, int teefd) {
+    struct OUTPUTFILE *f;
+
+    f = malloc(sizeof *f);
+    if (f == NULL )
+        bug("Out of memory");
+    f->fd = fd;
+    f->teefd = teefd;
+    f->buf = malloc(OUTPUT_BLOCK_SIZE);
+    f->teebuf = (teefd < 0) ? NULL : malloc(OUTPUT_BLOCK_SIZE);
+    if ((f->buf == NULL )|| ((teefd >= 0) && (f->teebuf == NULL)))
+        bug("Out of memory");
+    f->len = f->teelen = 0;
+    f->flush = flushmode;
+    if (flushmode == FLUSH_DEFAULT) /* what stdio would do */
+        f->flush = (isatty(fd) || ((teefd >= 0) && isatty(teefd))) ?
+                FLUSH_LINE : FLUSH_BLOCK;
+    return f;
+}
+
+void writeAll(int fd, const char *s, int l) {
+    int n;
+
+    while (l > 0) {
+        n = write(fd, s, l);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return; /* like stdio, output errors go unreported */
+        }
+        s += n;
+        l -= n;
+    }
+}
+
+void flushOutput(struct OUTPUTFILE *f) {
+    writeAll(f->fd, f->buf, f->len);
+    f->len = 0;
+    if (f->teefd >= 0) {
+        writeAll(f->teefd, f->teebuf, f->teelen);
+        f->teelen = 0;
+    }
+}
+
+void closeOutput(struct OUTPUTFILE *f) {
+    flushOutput(f);
+    if (f->fd > 2)
+        close(f->fd);
+}
+
+void flushMainOutput(void) {
+    if (mainoutput != NULL )
+        flushOutput(mainoutput);
+}
+
+/* append to one of the blocks of f, writing it out whenever it is full */
+void bufferOutput(int fd, char *buf, int *len, const char *s, int l) {
+    int n;
+
+    while (l > 0) {
+        if ((*len == 0) && (l >= OUTPUT_BLOCK_SIZE)) {
+            writeAll(fd, s, l);
+            return;
+        }
+        n = OUTPUT_BLOCK_SIZE - *len;
+        if (n > l)
+            n = l;
+        memcpy(buf + *len, s, n);
+        *len += n;
+        s += n;
+        l -= n;
+        if (*len == OUTPUT_BLOCK_SIZE) {
+            writeAll(fd, buf, *len);
+            *len = 0;
+        }
+    }
+}
+
+void putOutput(struct OUTPUTFILE *f, const char *s, int l) {
+    bufferOutput(f->fd, f->buf, &f->len, s, l);
+    if (f->teefd >= 0)
+        bufferOutput(f->teefd, f->teebuf, &f->teelen, s, l);
+}
+
+/* output text: CRs are dropped, and LFs become CR-LF in dosmode */
+void writeOutput(struct OUTPUTFILE *f, const char *s, int l) {
+    const char *end = s + l, *start = s, *cr, *lf;
+
+    while (s < end) {
+        cr = memchr(s, 13, end - s);
+        if (cr == NULL )
+            cr = end;
+        if (dosmode)
+            while ((lf = memchr(s, 10, cr - s)) != NULL ) {
+                putOutput(f, s, lf - s);
+                putOutput(f, "\r\n", 2);
+                s = lf + 1;
+            }
+        putOutput(f, s, cr - s);
+        s = cr + 1;
+    }
+    if ((f->flush == FLUSH_NOW)
+            || ((f->flush == FLUSH_LINE) && memchr(start, 10, l)))
+        flushOutput(f);
+}
+
+/* output as is and not to the -O copy, like the include markers always were */
+void writeOutputRaw(struct OUTPUTFILE *f, const char *s, int l) {
+    bufferOutput(f->fd, f->buf, &f->len, s, l);
+    if (f->flush != FLUSH_BLOCK)
+        flushOutput(f);
+}
+
+void outstring(const char *s, int l) {
+    if (capture != NULL)
+        captureOutput(s, l);
+    if (recordings)
+        recordOutput(s, l);
     if (C->out->bufsize) {
-        if (C->out->len + 1 == C->out->bufsize) {
-            C->out->bufsize = C->out->bufsize * 2;
+        if (C->out->len + l >= C->out->bufsize) {
+            while (C->out->len + l >= C->out->bufsize)
+                C->out->bufsize = C->out->bufsize * 2;
             C->out->buf = realloc(C->out->buf, C->out->bufsize);
             if (C->out->buf == NULL )
                 bug("Out of memory");
         }
-        C->out->buf[C->out->len++] = c;
+        memcpy(C->out->buf + C->out->len, s, l);
+        C->out->len += l;
+    } else
+        writeOutput(C->out->f, s, l);
+}
+
+void outchar(char c) {
+    outstring(&c, 1);
+}
+
+void sendout(const char *s, int l, int proc) /* only process the quotechar, that's all */
+{
+    const char *end = s + l, *p;
+
+    if (commented[iflevel]) {
+        replace_definition_with_blank_lines(s, s + l - 1, 0);
+        return;
+    }
+    while (s < end) {
+        /* copy runs up to the next 0 byte or quotechar */
+        p = memchr(s, 0, end - s);
+        if (p == NULL )
+            p = end;
+        if (proc && S->User.quotechar) {
+            const char *q = memchr(s, S->User.quotechar, p - s);
+            if (q != NULL )
+                p = q;
+        }
+        if (p > s)
+            outstring(s, p - s);
+        if (p == end)
+            break;
+        s = p + 1;
+        if (*p == 0)
+            continue;
+        if (s == end) /* the quotechar quotes the next char */
+            return;
+        if (*s != 0)
+            outstring(s, 1);
+        s++;
+    }
+}
+
+/* make room for position pos in the window of a streamed input.  The
+   window only ever advances through malloced_buf (see shiftIn); when it
+   hits the end, it slides back over the consumed part if that is at
+   least as large as the window, so each byte is moved O(1) times and the
+   buffer stays within a small multiple of the lookahead actually used. */
+void extendBuf(int pos) {
+    int consumed, size;
+    char *p;
+
+    if (pos < C->bufsize)
+        return;
+    consumed = C->buf - C->malloced_buf;
+    size = consumed + C->bufsize;
+    if (consumed >= C->len) {
+        memmove(C->malloced_buf, C->buf, C->len);
+        C->buf = C->malloced_buf;
+        C->bufsize = size;
+        consumed = 0;
+    }
+    if (pos >= C->bufsize) {
+        size *= 2;
+        if (size <= consumed + pos)
+            size = consumed + pos + 1;
+        p = realloc(C->malloced_buf, size);
+        if (p == NULL )
+            bug("Out of memory");
+        C->malloced_buf = p;
+        C->buf = p + consumed;
+        C->bufsize = size - consumed;
+    }
+}
+
+/* spare read-ahead blocks from closed input files */
+char *spareblocks[STACKDEPTH];
+int nspareblocks;
+
+struct INPUTFILE *openInputFd(int fd) {
+    struct INPUTFILE *f;
+
+    if (fd < 0)
+        return NULL;
+    f = malloc(sizeof *f);
+    if (f == NULL )
+        bug("Out of memory");
+    f->fd = fd;
+    f->text = f->textend = f->region = NULL;
+    f->regionlen = 0;
+    f->cached = NULL;
+    f->segs = NULL;
+    f->seg = 0;
+    if (nspareblocks > 0)
+        f->block = spareblocks[--nspareblocks];
+    else if ((f->block = malloc(INPUT_BLOCK_SIZE)) == NULL )
+        bug("Out of memory");
+    f->blockpos = f->blocklen = 0;
+    f->eof = 0;
+    return f;
+}
+
+#if USE_MMAP
+/* map a regular file for in-place scanning, between a page holding the
+   '\n' that precedes the input and a page of zeros; files with CRs are
+   copied without them into a buffer of the same shape */
+struct INPUTFILE *mapInput(int fd, int size) {
+    struct INPUTFILE *f;
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t len = ((size + pagesize - 1) / pagesize + 2) * pagesize;
+    char *base, *text, *p, *q, *end;
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    text = base + pagesize;
+    if (mmap(text, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0)
+            == MAP_FAILED) {
+        munmap(base, len);
+        return NULL;
+    }
+#if HAVE_MADVISE && defined(MADV_SEQUENTIAL)
+    madvise(text, size, MADV_SEQUENTIAL);
+#endif
+    f = malloc(sizeof *f);
+    if (f == NULL )
+        bug("Out of memory");
+    f->fd = -1;
+    f->block = NULL;
+    f->blockpos = f->blocklen = 0;
+    f->eof = 0;
+    f->cached = NULL;
+    f->segs = NULL;
+    f->seg = 0;
+    if (memchr(text, 13, size) == NULL ) {
+        text[-1] = '\n';
+        f->text = text;
+        f->textend = text + size;
+        f->region = base;
+        f->regionlen = len;
     } else {
-        if (dosmode && (c == 10)) {
-            fputc(13, C->out->f);
-            if (file_and_stdout)
-                fputc(13, stdout);
+        f->region = malloc(size + 2);
+        if (f->region == NULL )
+            bug("Out of memory");
+        f->region[0] = '\n';
+        f->text = f->textend = f->region + 1;
+        for (p = text, end = text + size; p < end; p = q + 1) {
+            q = memchr(p, 13, end - p);
+            if (q == NULL )
+                q = end;
+            memcpy(f->textend, p, q - p);
+            f->textend += q - p;
         }
-        if (c != 13) {
-            fputc(c, C->out->f);
-            if (file_and_stdout)
-                fputc(c, stdout);
+        *f->textend = 0;
+        f->regionlen = 0;
+        munmap(base, len);
+    }
+    close(fd);
+    return f;
+}
+#endif
+
+struct INPUTFILE *openInput(const char *name) {
+    int fd = open(name, O_RDONLY);
+#if USE_MMAP
+    struct INPUTFILE *f;
+    struct stat st;
+
+    if ((fd >= 0) && (fstat(fd, &st) == 0) && S_ISREG(st.st_mode)
+            && (st.st_size > 0) && (st.st_size < INT_MAX / 2)
+            && ((f = mapInput(fd, st.st_size)) != NULL ))
+        return f;
+#endif
+    return openInputFd(fd);
+}
+
+void releaseFile(struct FILECACHE *F);
+
+void closeInput(struct INPUTFILE *f) {
+    if (f->cached != NULL) {
+        releaseFile(f->cached);
+        free(f);
+        return;
+    }
+    if (f->text != NULL ) {
+#if USE_MMAP
+        if (f->regionlen)
+            munmap(f->region, f->regionlen);
+        else
+#endif
+            free(f->region);
+        free(f);
+        return;
+    }
+    close(f->fd);
+    if (nspareblocks < STACKDEPTH)
+        spareblocks[nspareblocks++] = f->block;
+    else
+        free(f->block);
+    free(f);
+}
+
+void freeRegion(char *region, size_t regionlen) {
+#if USE_MMAP
+    if (regionlen)
+        munmap(region, regionlen);
+    else
+#else
+    (void) regionlen; /* always 0 */
+#endif
+        free(region);
+}
+
+void releaseFile(struct FILECACHE *F) {
+    struct TEXTSEGS *T;
+
+    if (--F->refs == 0) {
+        while ((T = F->segs) != NULL) {
+            F->segs = T->next;
+            releaseSpecs(T->specs);
+            free(T->segs);
+            free(T);
         }
+        freeRegion(F->region, F->regionlen);
+        free(F);
     }
 }
 
-void sendout(const char *s, int l, int proc) /* only process the quotechar, that's all */
-{
-    int i;
+/* take F out of the table ; open files keep it until they are closed */
+void dropFile(struct FILECACHE *F) {
+    struct FILECACHE **q;
 
-    if (!commented[iflevel])
-        for (i = 0; i < l; i++) {
-            if (proc && (s[i] != 0) && (s[i] == S->User.quotechar)) {
-                i++;
-                if (i == l)
-                    return;
-            }
-            if (s[i] != 0)
-                outchar(s[i]);
+    for (q = &filecache[F->ino % FILECACHE_HASH]; *q != F; q = &(*q)->next)
+        ;
+    *q = F->next;
+    if (F->newer != NULL)
+        F->newer->older = F->older;
+    else
+        newestfile = F->older;
+    if (F->older != NULL)
+        F->older->newer = F->newer;
+    else
+        oldestfile = F->newer;
+    filecachelen -= (F->textend - F->text) + F->seglen;
+    releaseFile(F);
+}
+
+void clearFileCache(void) {
+    while (oldestfile != NULL)
+        dropFile(oldestfile);
+}
+
+void makeNewest(struct FILECACHE *F) {
+    if (F == newestfile)
+        return;
+    if (F->older != NULL)
+        F->older->newer = F->newer;
+    else
+        oldestfile = F->newer;
+    F->newer->older = F->older;
+    F->older = newestfile;
+    F->newer = NULL;
+    newestfile->newer = F;
+    newestfile = F;
+}
+
+/* an input on the text of F */
+struct INPUTFILE *borrowFile(struct FILECACHE *F) {
+    struct INPUTFILE *f;
+
+    f = malloc(sizeof *f);
+    if (f == NULL )
+        bug("Out of memory");
+    f->fd = -1;
+    f->block = NULL;
+    f->blockpos = f->blocklen = 0;
+    f->eof = 0;
+    f->text = F->text;
+    f->textend = F->textend;
+    f->region = NULL;
+    f->regionlen = 0;
+    f->cached = F;
+    f->segs = NULL;
+    f->seg = 0;
+    F->refs++;
+    return f;
+}
+
+/* openInput() for #include, served from the cache when the file has not
+   changed since */
+struct INPUTFILE *openIncluded(const char *name) {
+#if USE_MMAP
+    struct INPUTFILE *f;
+    struct FILECACHE *F;
+    struct stat st;
+    size_t l;
+
+    if ((filecachemax == 0) || (stat(name, &st) != 0) || !S_ISREG(st.st_mode))
+        return openInput(name);
+    for (F = filecache[st.st_ino % FILECACHE_HASH]; F != NULL; F = F->next)
+        if ((F->ino == st.st_ino) && (F->dev == st.st_dev))
+            break;
+    if (F != NULL) {
+        if ((F->size == st.st_size) && (F->mtime == st.st_mtime)) {
+            filehits++;
+            F->hits++;
+            makeNewest(F);
+            return borrowFile(F);
         }
+        dropFile(F);
+    }
+    filemisses++;
+    f = openInput(name);
+    if ((f == NULL) || (f->text == NULL))
+        return f;
+    l = f->textend - f->text;
+    if (l > filecachemax)
+        return f;
+    while (filecachelen + l > filecachemax)
+        dropFile(oldestfile);
+    F = malloc(sizeof *F);
+    if (F == NULL )
+        bug("Out of memory");
+    F->dev = st.st_dev;
+    F->ino = st.st_ino;
+    F->size = st.st_size;
+    F->mtime = st.st_mtime;
+    F->text = f->text;
+    F->textend = f->textend;
+    F->region = f->region;
+    F->regionlen = f->regionlen;
+    F->refs = 2;
+    F->hits = 0;
+    F->segs = NULL;
+    F->seglen = 0;
+    F->next = filecache[st.st_ino % FILECACHE_HASH];
+    filecache[st.st_ino % FILECACHE_HASH] = F;
+    F->older = newestfile;
+    F->newer = NULL;
+    if (newestfile != NULL)
+        newestfile->newer = F;
     else
-        replace_definition_with_blank_lines(s, s + l - 1, 0);
+        oldestfile = F;
+    newestfile = F;
+    filecachelen += l;
+    f->region = NULL;
+    f->cached = F;
+    return f;
+#else
+    return openInput(name);
+#endif
 }
 
-void extendBuf(int pos) {
-    char *p;
-    if (C->bufsize <= pos) {
-        C->bufsize += pos; /* approx double */
-        p = malloc(C->bufsize);
-        memcpy(p, C->buf, C->len);
-        free(C->malloced_buf);
-        C->malloced_buf = C->buf = p;
-        if (C->buf == NULL )
+void addTextSeg(struct TEXTSEGS *T, int *nalloced, int pos, int end) {
+    if (T->nsegs == *nalloced) {
+        *nalloced = 2 * *nalloced + 64;
+        T->segs = realloc(T->segs, *nalloced * sizeof *T->segs);
+        if (T->segs == NULL)
             bug("Out of memory");
     }
+    T->segs[T->nsegs].pos = pos;
+    T->segs[T->nsegs].end = end;
+    T->nsegs++;
 }
 
-char getChar(int pos) {
-    static int lastchar = -666;
-    int c;
+/* the places of the text of F where plainTextEnd() may stop under the
+   specs P : it only ever starts a step on a byte out of identifiers or
+   on the first byte of one */
+struct TEXTSEGS *textSegments(struct FILECACHE *F, struct SPECS *P) {
+    struct TEXTSEGS *T;
+    const unsigned char *t = (const unsigned char *) F->text;
+    int n = F->textend - F->text, o, e, nalloced, words;
+
+    for (T = F->segs; T != NULL; T = T->next)
+        if (T->specs == P) {
+            segreuses++;
+            return T;
+        }
+    T = malloc(sizeof *T);
+    if (T == NULL)
+        bug("Out of memory");
+    T->specs = shareSpecs(P);
+    T->segs = NULL;
+    T->nsegs = nalloced = 0;
+    words = (P->User.mStart[0] == 0);
+    for (o = 0; o < n; o = e) {
+        e = o + 1;
+        if (P->chars[t[o]] & CH_WORD) {
+            while ((e < n) && (P->chars[t[e]] & CH_WORD))
+                e++;
+            if (P->stop_first[t[o]])
+                addTextSeg(T, &nalloced, o, o);
+            else if (words)
+                addTextSeg(T, &nalloced, o, e);
+        } else if (P->stop_first[t[o]])
+            addTextSeg(T, &nalloced, o, o);
+    }
+    T->next = F->segs;
+    F->segs = T;
+    F->seglen += sizeof *T + nalloced * sizeof *T->segs;
+    filecachelen += sizeof *T + nalloced * sizeof *T->segs;
+    while ((filecachelen > filecachemax) && (oldestfile != F))
+        dropFile(oldestfile);
+    segbuilds++;
+    return T;
+}
+
+/* refill the read-ahead block; returns 0 at end of file */
+int readBlock(struct INPUTFILE *f) {
+    int n;
+
+    do {
+        n = read(f->fd, f->block, INPUT_BLOCK_SIZE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        bug("Error reading input file");
+    f->blockpos = 0;
+    f->blocklen = n;
+    return n > 0;
+}
+
+/* hand input up to position pos over to the current context, dropping CRs.
+   lineno counts the newlines preceding each char handed over, exactly as
+   if the chars were read one at a time; the last one is remembered across
+   files, like the old fgetc() loop did. */
+int lastchar = -666;
+
+void readInput(int pos) {
+    struct INPUTFILE *f = C->in;
+    char *p, *q, *end, c;
+    int n;
 
     if (lastchar == -666 && !strcmp(S->Meta.mEnd, "\n"))
         lastchar = '\n';
-
-    if (C->in == NULL ) {
-        if (pos >= C->len)
-            return 0;
-        else
-            return C->buf[pos];
+    if (f->text != NULL ) { /* in place: just move the end of the window */
+        n = f->textend - C->buf; /* position of the final 0 */
+        if (pos > n)
+            pos = n;
+        if (pos < C->len)
+            return;
+        if (lastchar == '\n')
+            C->lineno++;
+        for (p = C->buf + C->len;
+                (q = memchr(p, '\n', C->buf + pos - p)) != NULL ; p = q + 1)
+            C->lineno++;
+        if (pos == n) {
+            f->eof = 1;
+            lastchar = EOF;
+        } else
+            lastchar = (unsigned char) C->buf[pos];
+        C->len = pos + 1;
+        return;
     }
     extendBuf(pos);
+    while (pos == C->len) { /* the usual case: just one more char */
+        if (f->blockpos == f->blocklen)
+            break;
+        c = f->block[f->blockpos++];
+        if (c == 13)
+            continue;
+        if (lastchar == '\n')
+            C->lineno++;
+        lastchar = (unsigned char) c;
+        C->buf[C->len++] = c;
+        return;
+    }
     while (pos >= C->len) {
-        do {
-            c = fgetc(C->in);
-        } while (c == 13);
+        if (f->blockpos == f->blocklen && !readBlock(f)) {
+            f->eof = 1;
+            if (lastchar == '\n')
+                C->lineno++;
+            lastchar = EOF;
+            C->buf[C->len++] = 0;
+            continue;
+        }
+        p = f->block + f->blockpos;
+        end = f->block + f->blocklen;
+        n = pos + 1 - C->len;
+        if (end - p > n)
+            end = p + n;
+        q = memchr(p, 13, end - p);
+        if (q == p) { /* skip the CR */
+            f->blockpos++;
+            continue;
+        }
+        if (q != NULL )
+            end = q;
+        n = end - p;
+        memcpy(C->buf + C->len, p, n);
+        f->blockpos += n;
+        C->len += n;
         if (lastchar == '\n')
             C->lineno++;
-        lastchar = c;
-        if (c == EOF)
-            c = 0;
-        C->buf[C->len++] = (char) c;
+        while ((q = memchr(p, '\n', end - 1 - p)) != NULL ) {
+            C->lineno++;
+            p = q + 1;
+        }
+        lastchar = (unsigned char) end[-1];
+    }
+}
+
+char getChar(int pos) {
+    if (pos >= C->len) {
+        if (C->in == NULL )
+            return 0;
+        readInput(pos);
+        if (pos >= C->len) /* past the end of a file scanned in place */
+            return 0;
     }
     return C->buf[pos];
 }
 
+/* set up the buffer of the current context for reading C->in */
+void initInputBuf(void) {
+    if ((C->in != NULL )&& (C->in->text != NULL)){
+        C->buf = C->in->text - 1;
+        C->len = 1;
+        C->bufsize = C->in->textend - C->buf + 1;
+        C->malloced_buf = NULL;
+    } else {
+        C->bufsize = 80;
+        C->len = 0;
+        C->buf = C->malloced_buf = malloc(C->bufsize);
+    }
+}
+
 int whiteout(int *pos1, int *pos2) /* remove whitespace on both sides */
 {
     while ((*pos1 < *pos2) && isWhite(getChar(*pos1)))
@@ -882,16 +2004,16 @@ int identifierEnd(int start) {
     c = getChar(start);
     if (c == 0)
         return start;
-    if (c == S->User.quotechar) {
+    if (charFlags(c) & CH_QUOTE) {
         c = getChar(start + 1);
         if (c == 0)
             return (start + 1);
-        if (isDelim(c))
+        if (!(charFlags(c) & CH_WORD))
             return (start + 2);
         start += 2;
         c = getChar(start);
     }
-    while (!isDelim(c))
+    while (charFlags(c) & CH_WORD)
         c = getChar(++start);
     return start;
 }
@@ -906,174 +2028,403 @@ int iterIdentifierEnd(int start) {
     }
 }
 
-int IsInCharset(CHARSET_SUBSET x, int c) {
-    return (x[c >> LOG_LONG_BITS] & 1L << (c & ((1 << LOG_LONG_BITS) - 1))) != 0;
-}
+#define inClass(o, c) ((charFlags(c) & (o)->cls) != 0)
 
-int matchSequence(const char *s, int *pos) {
-    int i = *pos;
-    int match;
-    char c;
+/* the class of a special char of a delimiter string ; returns 0 for
+   the codes that stand for nothing */
+int seqClass(char s, struct MATCHOP *o) {
+    static const unsigned short cls[13] = { 0, CH_BLANK, CH_BLANK, CH_WHITE,
+            CH_WHITE, CH_ALPHA, CH_ALPHA | CH_WHITE, CH_DIGIT, CH_ID, CH_TAB,
+            CH_NL, CH_OP, CH_OP | CH_OPX };
+    int k = s & 0x1f;
 
-    while (*s != 0) {
-        if (!((*s) & 0x60)) { /* special sequences */
-            match = 1;
-            switch ((*s) & 0x1f) {
-            case '\001':
-                c = getChar(i++);
-                if ((c != ' ') && (c != '\t')) {
-                    match = 0;
-                    break;
-                }
-            case '\002':
-                i--;
-                do {
-                    c = getChar(++i);
-                } while ((c == ' ') || (c == '\t'));
-                break;
-            case '\003':
-                c = getChar(i++);
-                if ((c != ' ') && (c != '\t') && (c != '\n')) {
-                    match = 0;
-                    break;
-                }
-            case '\004':
-                i--;
-                do {
-                    c = getChar(++i);
-                } while ((c == ' ') || (c == '\t') || (c == '\n'));
-                break;
-            case '\006':
-                c = getChar(i++);
-                match = ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'))
-                        || (c == ' ') || (c == '\t') || (c == '\n');
-                break;
-            case '\005':
-                c = getChar(i++);
-                match = ((c >= 'a') && (c <= 'z'))
-                        || ((c >= 'A') && (c <= 'Z'));
-                break;
-            case '\007':
-                c = getChar(i++);
-                match = ((c >= '0') && (c <= '9'));
-                break;
-            case '\010':
-                c = getChar(i++);
-                match = IsInCharset(S->id_set, c);
-                break;
-            case '\011':
-                c = getChar(i++);
-                match = (c == '\t');
-                break;
-            case '\012':
-                c = getChar(i++);
-                match = (c == '\n');
-                break;
-            case '\013':
-                c = getChar(i++);
-                match = IsInCharset(S->op_set, c);
-                break;
-            case '\014':
-                c = getChar(i++);
-                match = IsInCharset(S->ext_op_set, c)
-                        || IsInCharset(S->op_set, c);
-                break;
+    if ((k == 0) || (k > 12))
+        return 0;
+    o->cls = cls[k];
+    o->neg = ((s & 0x80) != 0);
+    return 1;
+}
+
+struct MATCHER *matchers[64];
+
+/* compile a delimiter string, once for all the specs using it */
+struct MATCHER *compileSeq(const char *s) {
+    struct MATCHER *M;
+    struct MATCHOP *o;
+    unsigned int h = 0;
+    const char *t;
+    int k;
+
+    for (t = s; *t; t++)
+        h = h * 31 + (unsigned char) *t;
+    h &= 63;
+    for (M = matchers[h]; M != NULL; M = M->next)
+        if (!strcmp(M->s, s))
+            return M;
+    M = malloc(sizeof *M + 2 * strlen(s) * sizeof *o);
+    if (M == NULL)
+        bug("Out of memory.");
+    M->s = my_strdup(s);
+    M->next = matchers[h];
+    matchers[h] = M;
+    M->ctx.kind = MOP_NONE;
+    M->first = 0;
+    o = M->ops;
+    for (t = s; *t; t++) {
+        if ((*t) & 0x60) {
+            o->kind = MOP_CHAR;
+            o->c = *t;
+            o++;
+        } else if (!seqClass(*t, o)) {
+            if ((*t) & 0x80)
+                (o++)->kind = MOP_FAIL;
+        } else {
+            k = (*t) & 0x1f;
+            if ((k <= 4) && o->neg)
+                o->kind = ((k == 1) || (k == 3)) ? MOP_NOTRUN : MOP_FAIL;
+            else if ((k == 1) || (k == 3)) { /* one, then any number */
+                o->kind = MOP_CLASS;
+                o[1] = o[0];
+                (++o)->kind = MOP_STAR;
+            } else
+                o->kind = (k <= 4) ? MOP_STAR : MOP_CLASS;
+            o++;
+        }
+        if (t == s) { /* as a start sequence, a special char is a test on
+                         the char before the match */
+            M->first = o - M->ops;
+            if (!((*t) & 0x60) && seqClass(*t, &M->ctx)) {
+                k = (*t) & 0x1f;
+                M->ctx.kind = ((k == 2) || (k == 4)) ? MOP_NONE : MOP_CLASS;
             }
-            if ((*s) & 0x80)
-                match = !match;
-            if (!match)
+            if (!((*t) & 0x60) && ((*t) & 0x80) && (M->ctx.kind == MOP_NONE))
+                M->ctx.kind = MOP_FAIL;
+            if ((*t) & 0x60)
+                M->first = 0;
+        }
+    }
+    M->nops = o - M->ops;
+    return M;
+}
+
+void compileMode(struct MODE *M) {
+    M->cStart = compileSeq(M->mStart);
+    M->cEnd = compileSeq(M->mEnd);
+    M->cArgS = compileSeq(M->mArgS);
+    M->cArgSep = compileSeq(M->mArgSep);
+    M->cArgE = compileSeq(M->mArgE);
+    M->cArgRef = compileSeq(M->mArgRef);
+}
+
+int runOps(const struct MATCHOP *o, const struct MATCHOP *end, int *pos) {
+    int i = *pos;
+    char c;
+
+    for (; o < end; o++)
+        switch (o->kind) {
+        case MOP_CHAR:
+            if (getChar(i++) != (char) o->c)
                 return 0;
-        } else if (getChar(i++) != *s)
+            break;
+        case MOP_CLASS:
+            if (inClass(o, getChar(i++)) == o->neg)
+                return 0;
+            break;
+        case MOP_STAR:
+            while (inClass(o, getChar(i)))
+                i++;
+            break;
+        case MOP_NOTRUN:
+            c = getChar(i++);
+            if (inClass(o, c)) {
+                while (inClass(o, getChar(i)))
+                    i++;
+                return 0;
+            }
+            break;
+        default:
             return 0;
-        s++;
-    }
+        }
     *pos = i;
     return 1;
 }
 
-int matchEndSequence(const char *s, int *pos) {
-    if (*s == 0)
+int matchSequence(const struct MATCHER *M, int *pos) {
+    return runOps(M->ops, M->ops + M->nops, pos);
+}
+
+int matchEndSequence(const struct MATCHER *M, int *pos) {
+    if (M->s[0] == 0)
         return 1;
     /* if terminator is \n and we're at end of input, let it be... */
-    if (getChar(*pos) == 0 && s[0] == '\n' && s[1] == 0)
+    if (getChar(*pos) == 0 && M->s[0] == '\n' && M->s[1] == 0)
         return 1;
-    if (!matchSequence(s, pos))
+    if (!matchSequence(M, pos))
         return 0;
     if (S->preservelf && isWhite(getChar(*pos - 1)))
         (*pos)--;
     return 1;
 }
 
-int matchStartSequence(const char *s, int *pos) {
-    char c;
-    int match;
+int matchStartSequence(const struct MATCHER *M, int *pos) {
+    if (M->ctx.kind == MOP_FAIL)
+        return 0;
+    if ((M->ctx.kind == MOP_CLASS)
+            && (inClass(&M->ctx, getChar(*pos - 1)) == M->ctx.neg))
+        return 0;
+    return runOps(M->ops + M->first, M->ops + M->nops, pos);
+}
 
-    if (!((*s) & 0x60)) { /* special sequences from prev. context */
-        c = getChar(*pos - 1);
-        match = 1;
+/* mark in set[] the bytes a match of s can start with, the first
+   character being a context check if special and start is set ;
+   returns 1 if s can match without reading anything */
+int firstBytes(const char *s, int start, const struct SPECS *P, char *set) {
+    struct MATCHOP o;
+    int c, k;
+
+    if (start && !((*s) & 0x60)) {
         if (*s == 0)
             return 1;
-        switch ((*s) & 0x1f) {
-        case '\001':
-            if ((c != ' ') && (c != '\t')) {
-                match = 0;
-                break;
-            }
-        case '\002':
-            break;
-        case '\003':
-            if ((c != ' ') && (c != '\t') && (c != '\n')) {
-                match = 0;
-                break;
-            }
-        case '\004':
-            break;
-        case '\006':
-            if ((c == ' ') || (c == '\t') || (c == '\n'))
-                break;
-        case '\005':
-            match = ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'));
-            break;
-        case '\007':
-            match = ((c >= '0') && (c <= '9'));
-            break;
-        case '\010':
-            match = IsInCharset(S->id_set, c);
-            break;
-        case '\011':
-            match = (c == '\t');
-            break;
-        case '\012':
-            match = (c == '\n');
-            break;
-        case '\013':
-            match = IsInCharset(S->op_set, c);
-            break;
-        case '\014':
-            match = IsInCharset(S->ext_op_set, c) || IsInCharset(S->op_set, c);
-            break;
+        s++;
+    }
+    for (; *s != 0; s++) {
+        if ((*s) & 0x60) {
+            set[(unsigned char) *s] = 1;
+            return 0;
+        }
+        if ((*s) & 0x80) { /* negated classes : anything goes */
+            memset(set, 1, 256);
+            return 0;
         }
-        if ((*s) & 0x80)
-            match = !match;
-        if (!match)
+        if (!seqClass(*s, &o))
+            continue; /* unknown codes read nothing */
+        for (c = 1; c < 256; c++)
+            if (P->chars[c] & o.cls)
+                set[c] = 1;
+        k = (*s) & 0x1f;
+        if ((k != '\002') && (k != '\004')) /* these may be empty */
             return 0;
+    }
+    return 1;
+}
+
+void setModeChars(struct SPECS *P, unsigned short f, const char *s) {
+    for (; *s != 0; s++)
+        P->chars[(unsigned char) *s] |= f;
+}
+
+/* bytes of P an argument of mode M goes by : those which can neither
+   start a comment, nest, separate nor end arguments */
+void argInertTable(struct SPECS *P, const struct MODE *M, unsigned short nest,
+        char *inert) {
+    char set[256];
+    int c;
+
+    for (c = 0; c < 256; c++)
+        set[c] = (P->comment_first[c] != 0) || ((P->chars[c] & nest) != 0);
+    if (firstBytes(M->mArgSep, 0, P, set) || firstBytes(M->mArgE, 0, P, set))
+        memset(set, 1, sizeof set);
+    for (c = 0; c < 256; c++)
+        inert[c] = !set[c] || ((P->chars[c] & CH_WORD) != 0);
+    inert[0] = 0;
+    inert[(unsigned char) P->User.quotechar] = 0;
+}
+
+/* hash of what sameSpecs() compares */
+unsigned int hashSpecs(const struct SPECS *P) {
+    const struct MODE *M[2];
+    struct COMMENT *p;
+    unsigned int h;
+    int i;
+
+    M[0] = &P->User;
+    M[1] = &P->Meta;
+    h = hashIdent((const char *) P->chars, sizeof P->chars) + P->preservelf;
+    for (i = 0; i < 2; i++)
+        h = h * 31 + hashIdent(M[i]->mStart, strlen(M[i]->mStart))
+                + hashIdent(M[i]->mArgS, strlen(M[i]->mArgS))
+                + hashIdent(M[i]->mArgE, strlen(M[i]->mArgE))
+                + (unsigned char) M[i]->quotechar;
+    for (p = P->comments; p != NULL; p = p->next)
+        h = h * 31 + hashIdent(p->start, strlen(p->start));
+    return h;
+}
+
+void buildSpecsTables(struct SPECS *P) {
+    struct COMMENT *p;
+    char set[256];
+    int c, k;
+
+    compileMode(&P->User);
+    compileMode(&P->Meta);
+    for (c = 0; c < 256; c++)
+        P->chars[c] &= ~(CH_STACK | CH_UNSTACK | CH_MSTACK | CH_MUNSTACK
+                | CH_QUOTE);
+    setModeChars(P, CH_STACK, P->User.stackchar);
+    setModeChars(P, CH_UNSTACK, P->User.unstackchar);
+    setModeChars(P, CH_MSTACK, P->Meta.stackchar);
+    setModeChars(P, CH_MUNSTACK, P->Meta.unstackchar);
+    if (P->User.quotechar)
+        P->chars[(unsigned char) P->User.quotechar] |= CH_QUOTE;
+    memset(P->comment_first, 0, sizeof P->comment_first);
+    for (p = P->comments, k = 0; p != NULL; p = p->next, k++) {
+        memset(set, 0, sizeof set);
+        if (firstBytes(p->start, 1, P, set))
+            memset(set, 1, sizeof set);
+        set[0] = 1; /* end of input */
+        for (c = 0; c < 256; c++)
+            if (set[c])
+                P->comment_first[c] |= COMMENT_BIT(k);
+    }
+
+    memset(P->stop_first, 0, sizeof P->stop_first);
+    for (c = 0; c < 256; c++)
+        P->stop_first[c] = (P->comment_first[c] != 0);
+    if (firstBytes(P->Meta.mStart, 1, P, P->stop_first)
+            || ((P->User.mStart[0] != 0)
+                    && firstBytes(P->User.mStart, 1, P, P->stop_first))
+            || firstBytes(P->User.mArgRef, 0, P, P->stop_first))
+        memset(P->stop_first, 1, sizeof P->stop_first);
+    P->stop_first[(unsigned char) P->User.quotechar] = 1;
+    P->nstopbytes = 0;
+    P->stop_word = 0;
+    for (c = 0; c < 256; c++)
+        if (P->stop_first[c]) {
+            if (P->nstopbytes < (int) sizeof P->stopbytes)
+                P->stopbytes[P->nstopbytes] = c;
+            P->nstopbytes++;
+            if (!isDelim(c))
+                P->stop_word = 1;
+        }
+    P->lookahead = (strlen(P->User.mEnd) > 1) || (strlen(P->User.mArgS) > 1)
+            || (P->User.mEnd[0] && !(P->User.mEnd[0] & 0x60))
+            || (P->User.mArgS[0] && !(P->User.mArgS[0] & 0x60));
+    argInertTable(P, &P->User, CH_STACK | CH_UNSTACK, P->user_arg_inert);
+    argInertTable(P, &P->Meta, CH_MSTACK | CH_MUNSTACK, P->meta_arg_inert);
+    P->hash = hashSpecs(P);
+}
+
+/* which comments of the current specs may start at pos */
+unsigned int commentCandidates(int pos) {
+    return S->comment_first[(unsigned char) getChar(pos)];
+}
+
+/* first byte of [s, end) in the stop set of P */
+const char *scanStop(const char *s, const char *end, const struct SPECS *P) {
+#if defined(__SSE2__) && defined(__GNUC__)
+    __m128i v, hit;
+    int k, bits;
+
+    if (P->nstopbytes <= (int) sizeof P->stopbytes)
+        for (; end - s >= 16; s += 16) {
+            v = _mm_loadu_si128((const __m128i *) s);
+            hit = _mm_cmpeq_epi8(v, _mm_set1_epi8(P->stopbytes[0]));
+            for (k = 1; k < P->nstopbytes; k++)
+                hit = _mm_or_si128(hit,
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8(P->stopbytes[k])));
+            bits = _mm_movemask_epi8(hit);
+            if (bits)
+                return s + __builtin_ctz(bits);
+        }
+#endif
+    while ((s < end) && !P->stop_first[(unsigned char) *s])
         s++;
+    return s;
+}
+
+/* how far the window may be looked at without reading more input */
+int windowLimit(void) {
+    if ((C->in != NULL) && (C->in->text != NULL))
+        return C->in->textend - C->buf;
+    return C->len;
+}
+
+/* end of the text at the start of the window that ParseText() would
+   copy to the output as it is, one identifier or char at a time ; the
+   input is read as far as it would have been by then */
+int plainTextEnd(void) {
+    int p, q, i, lim, streamed, base = 0;
+    struct TEXTSEG *g = NULL, *gend = NULL;
+
+    streamed = (C->in != NULL) && (C->in->text == NULL);
+    lim = windowLimit();
+    if ((C->in != NULL) && (C->in->segs != NULL) && (C->in->segs->specs == S)) {
+        base = C->buf - C->in->text;
+        g = C->in->segs->segs + C->in->seg;
+        gend = C->in->segs->segs + C->in->segs->nsegs;
+        while ((g < gend) && (g->pos < base + 1))
+            g++;
     }
-    return matchSequence(s, pos);
+    if (!S->stop_word && (S->User.mStart[0] != 0)) {
+        if (g != NULL)
+            p = (g < gend) ? g->pos - base : lim;
+        else
+            p = scanStop(C->buf + 1, C->buf + lim, S) - C->buf;
+    } else
+        for (p = 1; (p < lim) && !S->stop_first[(unsigned char) C->buf[p]];) {
+            if ((g != NULL) && (g < gend) && (g->pos == base + p))
+                q = g->end - base;
+            else
+                for (q = p; (q < lim) && (charFlags(C->buf[q]) & CH_WORD); q++)
+                    ;
+            if ((q == lim) && (q > p) && streamed)
+                break; /* the identifier may go on */
+            if (S->User.mStart[0] == 0) {
+                if (S->lookahead) {
+                    i = q;
+                    matchEndSequence(S->User.cEnd, &i);
+                    i = q;
+                    matchSequence(S->User.cArgS, &i);
+                    lim = windowLimit();
+                }
+                if ((q > p) && ((findIdent(C->buf + p, q - p) >= 0)
+                        || isDefinedOp(C->buf + p, q - p)
+                        || ((C->namedargs != NULL)
+                                && (findNamedArg(C->buf + p, q - p) >= 0))))
+                    break;
+            }
+            p = (q > p) ? q : p + 1;
+            if (g != NULL) { /* nothing to see until the next segment */
+                while ((g < gend) && (g->pos < base + p))
+                    g++;
+                p = (g < gend) ? g->pos - base : lim;
+            }
+        }
+    if (g != NULL)
+        C->in->seg = g - C->in->segs->segs;
+    if ((p > 1) && (C->in != NULL) && (C->in->text != NULL))
+        getChar(p);
+    return p;
 }
 
-void AddToCharset(CHARSET_SUBSET x, int c) {
-    x[c >> LOG_LONG_BITS] |= 1L << (c & ((1 << LOG_LONG_BITS) - 1));
+/* first position from pos on where an argument loop has something to
+   check, going by identifiers and the bytes flagged in inert[] ; the
+   input is read as far as the loop would have read it */
+int skipArgText(int pos, const char *inert) {
+    int lim, x;
+
+    while (1) {
+        lim = windowLimit();
+        while ((pos < lim) && inert[(unsigned char) C->buf[pos]])
+            pos++;
+        if (inert[(unsigned char) getChar(pos)]) {
+            pos++; /* streamed input, read one more */
+            continue;
+        }
+        x = iterIdentifierEnd(pos);
+        if (x == pos)
+            return pos;
+        pos = x;
+    }
 }
 
-CHARSET_SUBSET MakeCharsetSubset(unsigned char *s) {
-    CHARSET_SUBSET x;
+/* make the chars of charset specification s the ones flagged with f */
+void setCharset(struct SPECS *P, unsigned short f, const unsigned char *s) {
     int i;
     unsigned char c;
 
-    x = malloc(CHARSET_SUBSET_LEN * sizeof(unsigned long));
-    for (i = 0; i < CHARSET_SUBSET_LEN; i++)
-        x[i] = 0;
+    for (i = 0; i < 256; i++)
+        P->chars[i] &= ~f;
     while (*s != 0) {
         if (!((*s) & 0x60)) { /* special sequences */
             if ((*s) & 0x80)
@@ -1087,39 +2438,38 @@ CHARSET_SUBSET MakeCharsetSubset(unsigned char *s) {
             case '\014':
                 bug("special sequence not allowed in charset specification");
             case '\003':
-                AddToCharset(x, '\n');
+                P->chars['\n'] |= f;
             case '\001':
-                AddToCharset(x, ' ');
+                P->chars[' '] |= f;
             case '\011':
-                AddToCharset(x, '\t');
+                P->chars['\t'] |= f;
                 break;
             case '\006':
-                AddToCharset(x, '\n');
-                AddToCharset(x, ' ');
-                AddToCharset(x, '\t');
+                P->chars['\n'] |= f;
+                P->chars[' '] |= f;
+                P->chars['\t'] |= f;
             case '\005':
                 for (c = 'A'; c <= 'Z'; c++)
-                    AddToCharset(x, c);
+                    P->chars[c] |= f;
                 for (c = 'a'; c <= 'z'; c++)
-                    AddToCharset(x, c);
+                    P->chars[c] |= f;
                 break;
             case '\007':
                 for (c = '0'; c <= '9'; c++)
-                    AddToCharset(x, c);
+                    P->chars[c] |= f;
                 break;
             case '\012':
-                AddToCharset(x, '\n');
+                P->chars['\n'] |= f;
                 break;
             }
         } else if ((s[1] == '-') && ((s[2] & 0x60) != 0) && (s[2] >= *s)) {
-            for (c = *s; c <= s[2]; c++)
-                AddToCharset(x, c);
+            for (i = *s; i <= s[2]; i++)
+                P->chars[i] |= f;
             s += 2;
         } else
-            AddToCharset(x, *s);
+            P->chars[*s] |= f;
         s++;
     }
-    return x;
 }
 
 int idequal(const char *b, int l, const char *s) {
@@ -1133,13 +2483,117 @@ int idequal(const char *b, int l, const char *s) {
     return 1;
 }
 
+unsigned int hashIdent(const char *b, int l) { /* FNV-1a */
+    unsigned int h = 2166136261u;
+
+    while (l--)
+        h = (h ^ (unsigned char) *b++) * 16777619u;
+    return h;
+}
+
+int identFilterKey(const char *b, int l) {
+    if (l == 0)
+        return 0;
+    return (((unsigned char) b[0] << 6) ^ ((unsigned char) b[l - 1] << 2) ^ l)
+            & (IDENT_FILTER_SIZE - 1);
+}
+
+/* identfilter[] entry of b, noted down for the #if cache and the
+   includes being recorded */
+unsigned int identFilterCount(const char *b, int l) {
+    int k = identFilterKey(b, l), i;
+
+    if (recordings)
+        noteLookup(b, l);
+    if ((ifdeps != NULL) && (ifdeps->n >= 0)) {
+        for (i = 0; (i < ifdeps->n) && (ifdeps->key[i] != k); i++)
+            ;
+        if (i == IFCACHE_DEPS)
+            ifdeps->n = -1;
+        else if (i == ifdeps->n) {
+            ifdeps->key[i] = k;
+            ifdeps->gen[i] = identgen[k];
+            ifdeps->n++;
+        }
+    }
+    return identfilter[k];
+}
+
+/* slot of the index where macro i is, or where it would go */
+int indexSlot(unsigned int h, const char *b, int l) {
+    int j, mask = macroindexsize - 1;
+
+    for (j = h & mask; macroindex[j] >= 0; j = (j + 1) & mask)
+        if ((macros[macroindex[j]].hash == h)
+                && (macros[macroindex[j]].namelen == l)
+                && !memcmp(macros[macroindex[j]].username, b, l))
+            break;
+    return j;
+}
+
+void growMacroIndex(void) {
+    int *old = macroindex;
+    int oldsize = macroindexsize, i;
+
+    macroindexsize = oldsize ? 2 * oldsize : 64;
+    macroindex = malloc(macroindexsize * sizeof *macroindex);
+    if (macroindex == NULL )
+        bug("Out of memory");
+    for (i = 0; i < macroindexsize; i++)
+        macroindex[i] = -1;
+    for (i = 0; i < oldsize; i++)
+        if (old[i] >= 0)
+            macroindex[indexSlot(macros[old[i]].hash, macros[old[i]].username,
+                    macros[old[i]].namelen)] = old[i];
+    free(old);
+}
+
 int findIdent(const char *b, int l) {
-    int i;
+    if (!identFilterCount(b, l) || (nmacros == 0))
+        return -1;
+    return macroindex[indexSlot(hashIdent(b, l), b, l)];
+}
 
-    for (i = 0; i < nmacros; i++)
-        if (idequal(b, l, macros[i].username))
-            return i;
-    return -1;
+/* findIdent() without noting the lookup down */
+int lookupIdent(const char *b, int l) {
+    if (!identfilter[identFilterKey(b, l)] || (nmacros == 0))
+        return -1;
+    return macroindex[indexSlot(hashIdent(b, l), b, l)];
+}
+
+int isDefinedOp(const char *b, int l) {
+    return definedop && (l == 7) && !memcmp(b, "defined", 7);
+}
+
+/* make the macro set up at macros[nmacros] by newmacro() visible */
+void commit_macro(void) {
+    struct MACRO *m = macros + nmacros;
+    int k;
+
+    if (2 * (nmacros + 1) > macroindexsize)
+        growMacroIndex();
+    m->hash = hashIdent(m->username, m->namelen);
+    macroindex[indexSlot(m->hash, m->username, m->namelen)] = nmacros++;
+    k = identFilterKey(m->username, m->namelen);
+    identfilter[k]++;
+    identgen[k]++;
+    macrodefs++;
+}
+
+/* remove the index entry for macro i, shifting back the rest of its run */
+void unindex_macro(int i) {
+    int j, k, home, mask = macroindexsize - 1;
+
+    j = indexSlot(macros[i].hash, macros[i].username, macros[i].namelen);
+    for (k = (j + 1) & mask; macroindex[k] >= 0; k = (k + 1) & mask) {
+        home = macros[macroindex[k]].hash & mask;
+        /* entry k may fill the hole at j unless its home lies in (j,k] */
+        if (((k - home) & mask) >= ((k - j) & mask)) {
+            macroindex[j] = macroindex[k];
+            j = k;
+        }
+    }
+    macroindex[j] = -1;
 }
 
 int findNamedArg(const char *b, int l) {
@@ -1155,21 +2609,19 @@ int findNamedArg(const char *b, int l) {
     }
 }
 
+/* consume l-1 chars, keeping the last one as buf[0]; this only moves the
+   start of the window, see extendBuf() */
 void shiftIn(int l) {
-    int i;
-
     if (l <= 1)
         return;
     l--;
-    if (l >= C->len)
+    if (l >= C->len) {
+        if ((C->in != NULL )&& (C->in->text != NULL))
+            C->buf += C->len;
         C->len = 0;
-    else {
-        if (C->len - l > 100) { /* we want to shrink that buffer */
-            C->buf += l;
-            C->bufsize -= l;
-        } else
-            for (i = l; i < C->len; i++)
-                C->buf[i - l] = C->buf[i];
+    } else {
+        C->buf += l;
+        C->bufsize -= l;
         C->len -= l;
         C->eof = (C->buf[0] == 0);
     }
@@ -1177,7 +2629,7 @@ void shiftIn(int l) {
         if (C->in == NULL )
             C->eof = 1;
         else
-            C->eof = feof(C->in);
+            C->eof = C->in->eof;
     }
 }
 
@@ -1185,44 +2637,42 @@ void initthings(int argc, char **argv) {
     char **arg, *s;
     int i, isinput, isoutput, ishelp, ismode, hasmeta, usrmode;
 
-    DefaultOp = MakeCharsetSubset(DEFAULT_OP_STRING);
-    PrologOp = MakeCharsetSubset(PROLOG_OP_STRING);
-    DefaultExtOp = MakeCharsetSubset(DEFAULT_OP_PLUS);
-    DefaultId = MakeCharsetSubset(DEFAULT_ID_STRING);
+    initCharClasses();
 
     nmacros = 0;
     nalloced = 31;
     macros = malloc(nalloced * sizeof *macros);
 
     S = malloc(sizeof *S);
+    S->refs = 1;
+    S->next_live = NULL;
+    livespecs = S;
     S->User = CUser;
     S->Meta = CMeta;
     S->comments = NULL;
-    S->stack_next = NULL;
     S->preservelf = 0;
-    S->op_set = DefaultOp;
-    S->ext_op_set = DefaultExtOp;
-    S->id_set = DefaultId;
+    memcpy(S->chars, charclass, sizeof S->chars);
+    setCharset(S, CH_OP, DEFAULT_OP_STRING);
+    setCharset(S, CH_OPX, DEFAULT_OP_PLUS);
+    setCharset(S, CH_ID, DEFAULT_ID_STRING);
+    buildSpecsTables(S);
 
     C = malloc(sizeof *C);
-    C->in = stdin;
-    C->argc = 0;
-    C->argv = NULL;
+    C->in = openInputFd(0);
+    C->args = NULL;
     C->filename = my_strdup("stdin");
     C->out = malloc(sizeof *(C->out));
-    C->out->f = stdout;
+    C->out->f = NULL;
     C->out->bufsize = 0;
     C->lineno = 1;
     isinput = isoutput = ismode = ishelp = hasmeta = usrmode = 0;
     nincludedirs = 0;
-    C->bufsize = 80;
-    C->len = 0;
-    C->buf = C->malloced_buf = malloc(C->bufsize);
     C->eof = 0;
     C->namedargs = NULL;
     C->in_comment = 0;
     C->ambience = FLAG_TEXT;
     C->may_have_args = 0;
+    C->body = NULL;
     commented[0] = 0;
     iflevel = 0;
     execallowed = 0;
@@ -1310,6 +2760,36 @@ void initthings(int argc, char **argv) {
             WarningLevel = atoi(*arg);
             continue;
         }
+        if (strcmp(*arg, "--includecache") == 0) {
+            if (!(*(++arg))) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            i = atoi(*arg);
+            filecachemax = (i > 0) ? (size_t) i * 1024 : 0;
+            continue;
+        }
+        if (strcmp(*arg, "--stats") == 0) {
+            showstats = 1;
+            continue;
+        }
+        if (strcmp(*arg, "--flush") == 0) {
+            if (!(*(++arg))) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            if (strcmp(*arg, "block") == 0)
+                flushmode = FLUSH_BLOCK;
+            else if (strcmp(*arg, "line") == 0)
+                flushmode = FLUSH_LINE;
+            else if (strcmp(*arg, "immediate") == 0)
+                flushmode = FLUSH_NOW;
+            else {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
 
         if (**arg == '+') {
             switch ((*arg)[1]) {
@@ -1358,7 +2838,8 @@ void initthings(int argc, char **argv) {
         } else if (**arg != '-') {
             ishelp |= isinput;
             isinput = 1;
-            C->in = fopen(*arg, "r");
+            closeInput(C->in);
+            C->in = openInput(*arg);
             free(C->filename);
             C->filename = my_strdup(*arg);
             if (C->in == NULL )
@@ -1397,7 +2878,7 @@ void initthings(int argc, char **argv) {
                 S->User = KUser;
                 S->Meta = KMeta;
                 S->preservelf = 1;
-                S->op_set = PrologOp;
+                setCharset(S, CH_OP, PROLOG_OP_STRING);
                 add_comment(S, "css", my_strdup("\213/*"), my_strdup("*/"), 0,
                         0); /* \!o */
                 add_comment(S, "cii", my_strdup("\\\n"), my_strdup(""), 0, 0);
@@ -1451,9 +2932,12 @@ void initthings(int argc, char **argv) {
                 }
                 ishelp |= isoutput;
                 isoutput = 1;
-                C->out->f = fopen(*arg, "w");
-                if (C->out->f == NULL )
+                if (C->out->f != NULL )
+                    closeOutput(C->out->f);
+                i = open(*arg, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (i < 0)
                     bug("Cannot create output file");
+                C->out->f = openOutputFd(i, file_and_stdout ? 1 : -1);
                 break;
             case 'D':
                 if ((*arg)[2] == 0) {
@@ -1499,6 +2983,18 @@ void initthings(int argc, char **argv) {
             exit(EXIT_FAILURE);
         }
     }
+    buildSpecsTables(S); /* the options may have changed the modes */
+    specstack = malloc(sizeof *specstack);
+    specstack->specs = S;
+    specstack->next = NULL;
+
+    initInputBuf();
+    if (C->out->f == NULL )
+        C->out->f = openOutputFd(1, -1);
+    else if (flushmode != FLUSH_DEFAULT) /* --flush came after -o */
+        C->out->f->flush = flushmode;
+    mainoutput = C->out->f;
+    atexit(flushMainOutput);
 
 #ifndef WIN_NT
     if ((nincludedirs == 0) && !NoStdInc) {
@@ -1509,12 +3005,13 @@ void initthings(int argc, char **argv) {
 
     for (i = 0; i < nmacros; i++) {
         if (macros[i].define_specs == NULL )
-            macros[i].define_specs = CloneSpecs(S);
+            macros[i].define_specs = shareSpecs(S);
         lookupArgRefs(i); /* for macro aliasing */
+        compileBody(i);
     }
 }
 
-int findCommentEnd(const char *endseq, char quote, char warn, int pos,
+int findCommentEnd(const struct MATCHER *endseq, char quote, char warn, int pos,
         int flags) {
     int i;
     char c;
@@ -1533,7 +3030,7 @@ int findCommentEnd(const char *endseq, char quote, char warn, int pos,
         }
         if (c == quote)
             pos += 2;
-        else if ((flags & PARSE_MACROS) && (c == S->User.quotechar))
+        else if ((flags & PARSE_MACROS) && (charFlags(c) & CH_QUOTE))
             pos += 2;
         else
             pos++;
@@ -1541,7 +3038,8 @@ int findCommentEnd(const char *endseq, char quote, char warn, int pos,
 }
 
 void SkipPossibleComments(int *pos, int cmtmode, int silentonly) {
-    int found;
+    int found, k;
+    unsigned int mask;
     struct COMMENT *c;
 
     if (C->in_comment)
@@ -1550,13 +3048,14 @@ void SkipPossibleComments(int *pos, int cmtmode, int silentonly) {
         found = 0;
         if (getChar(*pos) == 0)
             return; /* EOF */
-        for (c = S->comments; c != NULL ; c = c->next)
-            if (!(c->flags[cmtmode] & FLAG_IGNORE))
+        mask = commentCandidates(*pos);
+        for (c = S->comments, k = 0; mask && (c != NULL); c = c->next, k++)
+            if ((mask & COMMENT_BIT(k)) && !(c->flags[cmtmode] & FLAG_IGNORE))
                 if (!silentonly || (c->flags[cmtmode] == FLAG_COMMENT))
-                    if (matchStartSequence(c->start, pos)) {
-                        *pos = findCommentEnd(c->end, c->quote, c->warn, *pos,
+                    if (matchStartSequence(c->cstart, pos)) {
+                        *pos = findCommentEnd(c->cend, c->quote, c->warn, *pos,
                                 c->flags[cmtmode]);
-                        matchEndSequence(c->end, pos);
+                        matchEndSequence(c->cend, pos);
                         found = 1;
                         break;
                     }
@@ -1577,22 +3076,30 @@ int SplicePossibleUser(int *idstart, int *idend, int *sh_end, int *lg_end,
         int *argb, int *arge, int *argc, int idcheck, int *id, int cmtmode) {
     int match, k, pos;
 
-    if (!matchStartSequence(S->User.mStart, idstart))
+    if (!matchStartSequence(S->User.cStart, idstart))
         return 0;
     *idend = identifierEnd(*idstart);
     if ((*idend) && !getChar(*idend - 1))
         return 0;
+    /* no need to look for arguments after a word that is not a macro,
+       unless that would read further than the word */
+    if (idcheck && (C->namedargs == NULL) && !S->lookahead
+            && !identFilterCount(C->buf + *idstart, *idend - *idstart)
+            && !isDefinedOp(C->buf + *idstart, *idend - *idstart))
+        return 0;
 
     /* look for args or no args */
     *sh_end = *idend;
-    if (!matchEndSequence(S->User.mEnd, sh_end))
+    if (!matchEndSequence(S->User.cEnd, sh_end))
         *sh_end = -1;
     pos = *idend;
-    match = matchSequence(S->User.mArgS, &pos);
+    match = matchSequence(S->User.cArgS, &pos);
 
     if (idcheck) {
         *id = findIdent(C->buf + *idstart, *idend - *idstart);
-        if (*id < 0)
+        if ((*id < 0) && isDefinedOp(C->buf + *idstart, *idend - *idstart))
+            *id = DEFINED_OP;
+        else if (*id < 0)
             match = 0;
     }
     *lg_end = -1;
@@ -1605,22 +3112,22 @@ int SplicePossibleUser(int *idstart, int *idend, int *sh_end, int *lg_end,
             argb[*argc] = pos;
             k = 0;
             while (1) { /* look for mArgE, mArgSep, or comment-start */
-                pos = iterIdentifierEnd(pos);
+                pos = skipArgText(pos, S->user_arg_inert);
                 SkipPossibleComments(&pos, cmtmode, 0);
                 if (getChar(pos) == 0)
                     return (*sh_end >= 0); /* EOF */
-                if (strchr(S->User.stackchar, getChar(pos)))
+                if (charFlags(getChar(pos)) & CH_STACK)
                     k++;
                 if (k) {
-                    if (strchr(S->User.unstackchar, getChar(pos)))
+                    if (charFlags(getChar(pos)) & CH_UNSTACK)
                         k--;
                 } else {
                     arge[*argc] = pos;
-                    if (matchSequence(S->User.mArgSep, &pos)) {
+                    if (matchSequence(S->User.cArgSep, &pos)) {
                         match = 0;
                         break;
                     }
-                    if (matchEndSequence(S->User.mArgE, &pos)) {
+                    if (matchEndSequence(S->User.cArgE, &pos)) {
                         match = 1;
                         break;
                     }
@@ -1644,8 +3151,8 @@ int findMetaArgs(int start, int *p1b, int *p1e, int *p2b, int *p2e, int *endm,
 
     /* look for mEnd or mArgS */
     pos = start;
-    if (!matchSequence(S->Meta.mArgS, &pos)) {
-        if (!matchEndSequence(S->Meta.mEnd, &pos))
+    if (!matchSequence(S->Meta.cArgS, &pos)) {
+        if (!matchEndSequence(S->Meta.cEnd, &pos))
             return -1;
         *endm = pos;
         return 0;
@@ -1663,8 +3170,8 @@ int findMetaArgs(int start, int *p1b, int *p1e, int *p2b, int *p2e, int *endm,
             pos = hyp_end1;
             *argc = 0;
         }
-        if (!matchSequence(S->Meta.mArgSep, &pos)) {
-            if (!matchEndSequence(S->Meta.mArgE, &pos))
+        if (!matchSequence(S->Meta.cArgSep, &pos)) {
+            if (!matchEndSequence(S->Meta.cArgE, &pos))
                 bug(
                         "#define/#defeval requires an identifier or a single macro call");
             *endm = pos;
@@ -1674,19 +3181,18 @@ int findMetaArgs(int start, int *p1b, int *p1e, int *p2b, int *p2e, int *endm,
         *argc = 0;
         k = 0;
         while (1) { /* look for mArgE, mArgSep, or comment-start */
-            pos = iterIdentifierEnd(pos);
+            pos = skipArgText(pos, S->meta_arg_inert);
             SkipPossibleComments(&pos, FLAG_META, 0);
-            if (getChar(pos) != 0 && strchr(S->Meta.stackchar, getChar(pos)))
+            if (charFlags(getChar(pos)) & CH_MSTACK)
                 k++;
             if (k) {
-                if (getChar(pos) != 0
-                        && strchr(S->Meta.unstackchar, getChar(pos)))
+                if (charFlags(getChar(pos)) & CH_MUNSTACK)
                     k--;
             } else {
                 *p1e = pos;
-                if (matchSequence(S->Meta.mArgSep, &pos))
+                if (matchSequence(S->Meta.cArgSep, &pos))
                     break;
-                if (matchEndSequence(S->Meta.mArgE, &pos)) {
+                if (matchEndSequence(S->Meta.cArgE, &pos)) {
                     *endm = pos;
                     return 1;
                 }
@@ -1700,16 +3206,16 @@ int findMetaArgs(int start, int *p1b, int *p1e, int *p2b, int *p2e, int *endm,
     *p2b = pos;
     k = 0;
     while (1) { /* look for mArgE or comment-start */
-        pos = iterIdentifierEnd(pos);
+        pos = skipArgText(pos, S->meta_arg_inert);
         SkipPossibleComments(&pos, FLAG_META, 0);
-        if (getChar(pos) != 0 && strchr(S->Meta.stackchar, getChar(pos)))
+        if (charFlags(getChar(pos)) & CH_MSTACK)
             k++;
         if (k) {
-            if (getChar(pos) != 0 && strchr(S->Meta.unstackchar, getChar(pos)))
+            if (charFlags(getChar(pos)) & CH_MUNSTACK)
                 k--;
         } else {
             *p2e = pos;
-            if (matchEndSequence(S->Meta.mArgE, &pos))
+            if (matchEndSequence(S->Meta.cArgE, &pos))
                 break;
         }
         if (getChar(pos) == 0)
@@ -1720,349 +3226,638 @@ int findMetaArgs(int start, int *p1b, int *p1e, int *p2b, int *p2e, int *endm,
     return 2;
 }
 
+/* output buffers of ProcessText(), one per nesting level, kept for reuse */
+struct OUTPUTCONTEXT **textout;
+int ntextout, textdepth;
+
+/* the result lives in the arena, until the caller's arenaRelease() */
 char *ProcessText(const char *buf, int l, int ambience) {
     char *s;
     struct INPUTCONTEXT *T;
-
-    if (l == 0) {
-        s = malloc(1);
-        s[0] = 0;
-        return s;
+    struct OUTPUTCONTEXT *O;
+    struct ARENAMARK m;
+
+    if (l == 0)
+        return arenaStrdup("", 0);
+    if (textdepth == ntextout) {
+        textout = realloc(textout, (ntextout + 1) * sizeof *textout);
+        O = textout[ntextout++] = malloc(sizeof *O);
+        if ((textout == NULL) || (O == NULL))
+            bug("Out of memory");
+        O->buf = malloc(80);
+        O->bufsize = 80;
+        O->f = NULL;
     }
-    s = malloc(l + 2);
+    O = textout[textdepth++];
+    O->len = 0;
+    m = arenaMark();
+    s = arenaAlloc(l + 2);
     s[0] = '\n';
     memcpy(s + 1, buf, l);
     s[l + 1] = 0;
     T = C;
-    C = malloc(sizeof *C);
-    C->out = malloc(sizeof *(C->out));
+    C = arenaAlloc(sizeof *C);
+    C->out = O;
     C->in = NULL;
-    C->argc = T->argc;
-    C->argv = T->argv;
+    C->args = T->args;
     C->filename = T->filename;
-    C->out->buf = malloc(80);
-    C->out->len = 0;
-    C->out->bufsize = 80;
-    C->out->f = NULL;
     C->lineno = T->lineno;
     C->bufsize = l + 2;
     C->len = l + 1;
-    C->buf = C->malloced_buf = s;
+    C->buf = s;
+    C->malloced_buf = NULL;
     C->eof = 0;
     C->namedargs = T->namedargs;
     C->in_comment = T->in_comment;
     C->ambience = ambience;
     C->may_have_args = T->may_have_args;
+    C->body = NULL;
 
     ProcessContext();
     outchar(0); /* note that outchar works with the half-destroyed context ! */
-    s = C->out->buf;
-    free(C->out);
-    free(C);
     C = T;
-    return s;
+    textdepth--;
+    arenaRelease(m);
+    return arenaStrdup(O->buf, O->len - 1);
 }
 
-int SpliceInfix(const char *buf, int pos1, int pos2, char *sep, int *spl1,
-        int *spl2) {
-    int pos, numpar, l;
-    const char *p;
-
-    numpar = 0;
-    l = strlen(sep);
-    for (pos = pos2 - 1, p = buf + pos; pos >= pos1; pos--, p--) {
-        if (*p == ')')
-            numpar++;
-        if (*p == '(')
-            numpar--;
-        if (numpar < 0)
-            return 0;
-        if ((numpar == 0) && (pos2 - pos >= l) && !strncmp(p, sep, l)) {
-            *spl1 = pos;
-            *spl2 = pos + l;
-            return 1;
-        }
-    }
+/* first byte that a sequence must consume to match, or 0 if it has none */
+static int firstLiteral(const char *s) {
+    for (; *s != 0; s++)
+        if ((*s) & 0x60)
+            return (unsigned char) *s;
     return 0;
 }
 
-int DoArithmEval(char *buf, int pos1, int pos2, int *result) {
-    int spl1, spl2, result1, result2, l;
-    char c, *p;
-
-    while ((pos1 < pos2) && isWhite(buf[pos1]))
-        pos1++;
-    while ((pos1 < pos2) && isWhite(buf[pos2 - 1]))
-        pos2--;
-    if (pos1 == pos2)
-        return 0;
+static int hasByte(const char *b, int l, int c) {
+    return (c != 0) && (memchr(b, c, l) != NULL);
+}
 
-    /* look for C operators starting with lowest precedence */
+/* would ProcessText(b, l, FLAG_USER) give back the text unchanged?  The
+   test is conservative: a sequence can only match where its first literal
+   byte occurs, and without a user macro start every identifier has to be
+   looked up.  A "no" only means the text gets expanded the usual way. */
+int isInertText(const char *b, int l) {
+    struct COMMENT *p;
+    const char *e;
+    int i;
 
-    if (SpliceInfix(buf, pos1, pos2, "||", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
-            return 0;
-        *result = result1 || result2;
-        return 1;
+    if (commented[iflevel] || (memchr(b, 0, l) != NULL))
+        return 0;
+    if (hasByte(b, l, S->User.quotechar))
+        return 0;
+    i = firstLiteral(S->Meta.mStart);
+    if ((i == 0) || hasByte(b, l, i))
+        return 0;
+    i = firstLiteral(S->User.mArgRef);
+    if ((i == 0) || hasByte(b, l, i))
+        return 0;
+    for (p = S->comments; p != NULL; p = p->next)
+        if (!(p->flags[FLAG_USER] & FLAG_IGNORE)) {
+            i = firstLiteral(p->start);
+            if ((i == 0) || hasByte(b, l, i))
+                return 0;
+        }
+    if (S->User.mStart[0] != 0) {
+        i = firstLiteral(S->User.mStart);
+        return (i != 0) && !hasByte(b, l, i);
     }
-
-    if (SpliceInfix(buf, pos1, pos2, "&&", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
+    for (e = b + l; b < e; b += i) {
+        for (i = 0; (b + i < e) && !isDelim(b[i]); i++)
+            ;
+        if (i == 0)
+            i = 1;
+        else if ((findIdent(b, i) >= 0) || isDefinedOp(b, i)
+                || ((C->namedargs != NULL) && (findNamedArg(b, i) >= 0)))
             return 0;
-        *result = result1 && result2;
-        return 1;
     }
+    return 1;
+}
 
-    if (SpliceInfix(buf, pos1, pos2, "|", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
-            return 0;
-        *result = result1 | result2;
-        return 1;
+void releaseBody(struct MACROBODY *B) {
+    if ((B != NULL) && (--B->refs == 0)) {
+        free(B->segs);
+        free(B);
     }
+}
 
-    if (SpliceInfix(buf, pos1, pos2, "^", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
-            return 0;
-        *result = result1 ^ result2;
-        return 1;
+static void addSegment(struct MACROBODY *B, int *nalloced, int pos, int end,
+        int kind, int arg) {
+    if (B->nsegs == *nalloced) {
+        *nalloced = 2 * (*nalloced) + 8;
+        B->segs = realloc(B->segs, *nalloced * sizeof *B->segs);
+        if (B->segs == NULL)
+            bug("Out of memory");
     }
+    B->segs[B->nsegs].pos = pos;
+    B->segs[B->nsegs].end = end;
+    B->segs[B->nsegs].kind = kind;
+    B->segs[B->nsegs].arg = arg;
+    B->nsegs++;
+}
 
-    if (SpliceInfix(buf, pos1, pos2, "&", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
-            return 0;
-        *result = result1 & result2;
-        return 1;
-    }
+/* find the places in the body of macro n where the scanner could do
+   anything but copy text, under the specs the macro was defined with.
+   Positions inside an identifier are left out when the only thing that
+   could happen there is a user macro call; ParseBody() never skips to
+   such a position, and hands over to ParseText() if it gets there. */
+void compileBody(int n) {
+    struct MACRO *M = macros + n;
+    struct MACROBODY *B;
+    struct INPUTCONTEXT X, *T;
+    struct SPECS *P;
+    struct COMMENT *c;
+    int pos, idend, end, kind, arg, i, k, nalloced;
+    unsigned int mask;
 
-    if (SpliceInfix(buf, pos1, pos2, "!=", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2)) {
-            /* revert to string comparison */
-            while ((pos1 < spl1) && isWhite(buf[spl1 - 1]))
-                spl1--;
-            while ((pos2 > spl2) && isWhite(buf[spl2]))
-                spl2++;
-            if (spl1 - pos1 != pos2 - spl2)
-                *result = 1;
-            else
-                *result = (strncmp(buf + pos1, buf + spl2, spl1 - pos1) != 0);
-        } else
-            *result = (result1 != result2);
-        return 1;
+    releaseBody(M->body);
+    M->body = NULL;
+    if ((M->macrotext[0] == 0) || (M->define_specs == NULL))
+        return;
+    P = S;
+    S = M->define_specs;
+    if (S->User.quotechar && !isDelim(S->User.quotechar)) {
+        S = P; /* it could hide in an identifier */
+        return;
     }
+    B = malloc(sizeof *B + M->macrolen + 2);
+    if (B == NULL)
+        bug("Out of memory");
+    B->refs = 1;
+    B->text = (char *) (B + 1);
+    B->text[0] = '\n';
+    memcpy(B->text + 1, M->macrotext, M->macrolen + 1);
+    B->len = M->macrolen + 1;
+    B->segs = NULL;
+    B->nsegs = nalloced = 0;
+    B->constant = 1;
+    B->checked = -1;
+    B->metas = 0;
+    B->quietchecked = -1;
 
-    if (SpliceInfix(buf, pos1, pos2, "==", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2)) {
-            /* revert to string comparison */
-            while ((pos1 < spl1) && isWhite(buf[spl1 - 1]))
-                spl1--;
-            while ((pos2 > spl2) && isWhite(buf[spl2]))
-                spl2++;
-            if (spl1 - pos1 != pos2 - spl2)
-                *result = 0;
-            else
-                *result = (strncmp(buf + pos1, buf + spl2, spl1 - pos1) == 0);
-        } else
-            *result = (result1 == result2);
-        return 1;
+    T = C;
+    C = &X;
+    memset(C, 0, sizeof *C);
+    C->buf = B->text;
+    C->len = B->len;
+    C->bufsize = B->len + 1;
+    C->filename = T->filename;
+    C->lineno = T->lineno;
+    for (pos = 1; pos < B->len; pos++) {
+        kind = -1;
+        arg = 0;
+        end = pos + 1;
+        if (B->text[pos] == S->User.quotechar)
+            kind = SEG_SCAN;
+        mask = commentCandidates(pos);
+        for (c = S->comments, k = 0; (kind < 0) && mask && (c != NULL);
+                c = c->next, k++) {
+            i = pos;
+            if ((mask & COMMENT_BIT(k)) && !(c->flags[FLAG_META] & FLAG_IGNORE)
+                    && matchStartSequence(c->cstart, &i)) {
+                kind = SEG_SCAN;
+                if ((c->flags[FLAG_META] | c->flags[FLAG_USER]
+                        | c->flags[FLAG_TEXT]) & PARSE_MACROS)
+                    B->metas = 1;
+            }
+        }
+        i = pos;
+        if ((kind < 0) && matchStartSequence(S->Meta.cStart, &i)) {
+            kind = SEG_SCAN;
+            B->metas = 1;
+        }
+        i = pos;
+        if ((kind < 0) && matchStartSequence(S->User.cStart, &i)
+                && ((idend = identifierEnd(i)) > i)) {
+            end = idend;
+            if ((M->argnames != NULL) && matchEndSequence(S->User.cEnd, &end))
+                for (arg = 0; M->argnames[arg] != NULL; arg++)
+                    if (idequal(B->text + i, idend - i, M->argnames[arg])) {
+                        kind = SEG_NAMEDARG;
+                        break;
+                    }
+            if (kind < 0) {
+                if ((pos == i) && !isDelim(B->text[pos - 1])
+                        && !isDelim(B->text[pos]))
+                    continue;
+                kind = SEG_IDENT;
+                arg = i;
+                end = idend;
+            }
+        }
+        i = pos;
+        if (((kind < 0) || (kind == SEG_IDENT))
+                && matchSequence(S->User.cArgRef, &i)
+                && (B->text[i] >= '1') && (B->text[i] <= '9')) {
+            if (kind < 0) {
+                kind = SEG_ARGREF;
+                arg = B->text[i] - '1';
+                end = i + 1;
+            } else
+                kind = SEG_SCAN;
+        }
+        if (kind >= 0)
+            addSegment(B, &nalloced, pos, end, kind, arg);
+        if (kind != SEG_IDENT)
+            B->constant = 0;
     }
+    C = T;
+    S = P;
+    M->body = B;
+}
 
-    if (SpliceInfix(buf, pos1, pos2, "=~", &spl1, &spl2)) {
-#if ! HAVE_FNMATCH_H
-        bug("globbing support has not been compiled in");
-#endif
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2)) {
-            char *str1, *str2;
-
-            /* revert to string comparison */
-            while ((pos1 < spl1) && isWhite(buf[spl1 - 1]))
-                spl1--;
-            while ((pos2 > spl2) && isWhite(buf[spl2]))
-                spl2++;
-            str1 = strdup(buf + pos1);
-            str1[spl1 - pos1] = '\0';
-            str2 = strdup(buf + spl2);
-            str2[pos2 - spl2] = '\0';
-            *result = (fnmatch(str2, str1, 0) == 0);
-            free(str1);
-            free(str2);
-        } else
-            *result = (result1 == result2);
-        return 1;
-    }
+/* is segment k of B a user macro call, as far as ParseBody() can tell? */
+static int isCallSeg(struct MACROBODY *B, int k) {
+    struct BODYSEG *g = B->segs + k;
 
-    if (SpliceInfix(buf, pos1, pos2, ">=", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2)) {
-            /* revert to string comparison */
-            while ((pos1 < spl1) && isWhite(buf[spl1 - 1]))
-                spl1--;
-            while ((pos2 > spl2) && isWhite(buf[spl2]))
-                spl2++;
-            l = spl1 - pos1;
-            if (l > pos2 - spl2)
-                l = pos2 - spl2;
-            result1 = strncmp(buf + pos1, buf + spl2, l);
-            *result = (result1 > 0)
-                    || ((result1 == 0) && (spl1 - pos1 >= pos2 - spl2));
-        } else
-            *result = (result1 >= result2);
-        return 1;
-    }
+    return (g->kind != SEG_IDENT)
+            || (findIdent(B->text + g->arg, g->end - g->arg) >= 0)
+            || isDefinedOp(B->text + g->arg, g->end - g->arg);
+}
 
-    if (SpliceInfix(buf, pos1, pos2, ">", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2)) {
-            /* revert to string comparison */
-            while ((pos1 < spl1) && isWhite(buf[spl1 - 1]))
-                spl1--;
-            while ((pos2 > spl2) && isWhite(buf[spl2]))
-                spl2++;
-            l = spl1 - pos1;
-            if (l > pos2 - spl2)
-                l = pos2 - spl2;
-            result1 = strncmp(buf + pos1, buf + spl2, l);
-            *result = (result1 > 0)
-                    || ((result1 == 0) && (spl1 - pos1 > pos2 - spl2));
-        } else
-            *result = (result1 > result2);
-        return 1;
-    }
+/* does the body of macro n expand to itself?  Its identifiers are looked
+   up again only when macros were defined since the last time, or when an
+   #if condition or an include being recorded has to see the lookups. */
+int isConstantBody(struct MACROBODY *B) {
+    int k;
 
-    if (SpliceInfix(buf, pos1, pos2, "<=", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2)) {
-            /* revert to string comparison */
-            while ((pos1 < spl1) && isWhite(buf[spl1 - 1]))
-                spl1--;
-            while ((pos2 > spl2) && isWhite(buf[spl2]))
-                spl2++;
-            l = spl1 - pos1;
-            if (l > pos2 - spl2)
-                l = pos2 - spl2;
-            result1 = strncmp(buf + pos1, buf + spl2, l);
-            *result = (result1 < 0)
-                    || ((result1 == 0) && (spl1 - pos1 <= pos2 - spl2));
-        } else
-            *result = (result1 <= result2);
-        return 1;
+    if ((B == NULL) || !B->constant)
+        return 0;
+    if ((B->checked != macrodefs) || recordings || (ifdeps != NULL)) {
+        for (k = 0; k < B->nsegs; k++)
+            if (isCallSeg(B, k))
+                return 0;
+        B->checked = macrodefs;
     }
+    return 1;
+}
 
-    if (SpliceInfix(buf, pos1, pos2, "<", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2)) {
-            /* revert to string comparison */
-            while ((pos1 < spl1) && isWhite(buf[spl1 - 1]))
-                spl1--;
-            while ((pos2 > spl2) && isWhite(buf[spl2]))
-                spl2++;
-            l = spl1 - pos1;
-            if (l > pos2 - spl2)
-                l = pos2 - spl2;
-            result1 = strncmp(buf + pos1, buf + spl2, l);
-            *result = (result1 < 0)
-                    || ((result1 == 0) && (spl1 - pos1 < pos2 - spl2));
-        } else
-            *result = (result1 < result2);
-        return 1;
-    }
+/* can expanding macro id run a meta-macro, directly or through the
+   macros it calls?  Unknown bodies and recursion count as "yes". */
+int quietMacro(int id) {
+    struct MACROBODY *B = macros[id].body;
+    struct BODYSEG *g;
+    int k, id2;
 
-    if (SpliceInfix(buf, pos1, pos2, "+", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
-            return 0;
-        *result = result1 + result2;
+    if (!macros[id].macrotext[0])
         return 1;
+    if ((B == NULL) || B->metas)
+        return 0;
+    if (B->quietchecked == macrodefs)
+        return B->quiet;
+    B->quietchecked = macrodefs;
+    B->quiet = 0;
+    for (k = 0; k < B->nsegs; k++) {
+        g = B->segs + k;
+        if ((g->kind == SEG_IDENT)
+                && ((id2 = lookupIdent(B->text + g->arg, g->end - g->arg)) >= 0)
+                && !quietMacro(id2))
+            return 0;
     }
+    B->quiet = 1;
+    return 1;
+}
 
-    if (SpliceInfix(buf, pos1, pos2, "-", &spl1, &spl2))
-        if (spl1 != pos1) {
-            if (!DoArithmEval(buf, pos1, spl1, &result1)
-                    || !DoArithmEval(buf, spl2, pos2, &result2))
-                return 0;
-            *result = result1 - result2;
-            return 1;
-        }
+/* can ProcessText(b, l, FLAG_USER) run a meta-macro?  Conservative like
+   isInertText() : any identifier that names a macro is a call. */
+int quietText(const char *b, int l) {
+    const char *e;
+    int i, id;
 
-    if (SpliceInfix(buf, pos1, pos2, "*", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
+    i = firstLiteral(S->Meta.mStart);
+    if ((i == 0) || hasByte(b, l, i))
+        return 0;
+    for (e = b + l; b < e; b += i) {
+        for (i = 0; (b + i < e) && !isDelim(b[i]); i++)
+            ;
+        if (i == 0)
+            i = 1;
+        else if (((id = lookupIdent(b, i)) >= 0) && !quietMacro(id))
             return 0;
-        *result = result1 * result2;
-        return 1;
     }
+    return 1;
+}
 
-    if (SpliceInfix(buf, pos1, pos2, "/", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
-            return 0;
-        if (result2 == 0)
-            bug("Division by zero in expression");
-        *result = result1 / result2;
-        return 1;
-    }
+/* one step of the scanner through a compiled macro body: argument
+   references are substituted and plain text is sent out in one go.
+   Returns 0 if ParseText() has to take the step itself. */
+int ParseBody(void) {
+    struct MACROBODY *B = C->body;
+    struct BODYSEG *g;
+    int off, p, k;
 
-    if (SpliceInfix(buf, pos1, pos2, "%", &spl1, &spl2)) {
-        if (!DoArithmEval(buf, pos1, spl1, &result1)
-                || !DoArithmEval(buf, spl2, pos2, &result2))
+    if (C->bodymodes != modechanges) { /* the segments may be stale */
+        C->body = NULL;
+        return 0;
+    }
+    off = C->buf + 1 - B->text;
+    if (off >= B->len)
+        return 0;
+    for (k = C->bodyseg; (k < B->nsegs) && (B->segs[k].pos < off); k++)
+        ;
+    C->bodyseg = k;
+    g = B->segs + k;
+    if ((k < B->nsegs) && (g->pos == off) && (g->kind != SEG_IDENT)) {
+        if (g->kind == SEG_SCAN)
             return 0;
-        if (result2 == 0)
-            bug("Division by zero in expression");
-        *result = result1 % result2;
+        if (g->arg < C->args->argc) {
+            macroArg(g->arg);
+            sendout(C->args->argv[g->arg], C->args->argl[g->arg], 0);
+        }
+        shiftIn(g->end - off + 1);
         return 1;
     }
+    if (((k == B->nsegs) || (g->pos != off)) && !isDelim(B->text[off - 1])
+            && !isDelim(B->text[off]))
+        return 0; /* inside an identifier */
+    /* walk identifiers and single chars as ParseText() would, up to
+       something it would act upon */
+    p = off;
+    while (p < B->len) {
+        while ((k < B->nsegs) && (B->segs[k].pos < p))
+            k++;
+        if ((k < B->nsegs) && (B->segs[k].pos == p) && isCallSeg(B, k))
+            break;
+        if (!(charFlags(B->text[p]) & CH_WORD))
+            p++;
+        else
+            while (charFlags(B->text[p]) & CH_WORD)
+                p++;
+    }
+    if (p == off)
+        return 0;
+    sendout(C->buf + 1, p - off, 0);
+    shiftIn(p - off + 1);
+    return 1;
+}
 
-    if (buf[pos1] == '~') {
-        if (!DoArithmEval(buf, pos1 + 1, pos2, &result1))
-            return 0;
-        *result = ~result1;
-        return 1;
+/* #eval and #if expressions : C operators over 64-bit integers, read in
+   one pass by precedence climbing. A value that is not a number keeps
+   the text it comes from, which the comparisons fall back to. */
+typedef struct EXPRVAL {
+    long long v;
+    int ok; /* v is meaningful */
+    int divzero; /* a division by zero is on the way to it */
+    int b, e; /* the text of the value */
+} EXPRVAL;
+
+typedef struct EXPRLEX {
+    const char *buf;
+    int pos, end;
+    int tok; /* index in exprops[], or EX_WORD / EX_END */
+    int tb, te; /* extent of the current token */
+    int error; /* not an expression at all */
+} EXPRLEX;
+
+#define EX_WORD -1
+#define EX_END  -2
+
+/* two-char operators first ; prec 0 for the non-binary ones */
+static const struct {
+    const char *s;
+    int prec;
+} exprops[] = { { "||", 1 }, { "&&", 2 }, { "==", 6 }, { "!=", 6 },
+        { "=~", 6 }, { "<=", 7 }, { ">=", 7 }, { "|", 3 }, { "^", 4 },
+        { "&", 5 }, { "<", 7 }, { ">", 7 }, { "+", 8 }, { "-", 8 }, { "*", 9 },
+        { "/", 9 }, { "%", 9 }, { "!", 0 }, { "~", 0 }, { "(", 0 },
+        { ")", 0 } };
+
+#define NEXPROPS ((int) (sizeof exprops / sizeof exprops[0]))
+
+int exprOp(const EXPRLEX *L, int pos) {
+    int k, l;
+
+    if (strchr("|&=!<>^+-*/%~()", L->buf[pos]) == NULL)
+        return EX_WORD;
+    for (k = 0; k < NEXPROPS; k++) {
+        l = strlen(exprops[k].s);
+        if ((L->end - pos >= l) && !strncmp(L->buf + pos, exprops[k].s, l))
+            return k;
     }
+    return EX_WORD;
+}
 
-    if (buf[pos1] == '!') {
-        if (!DoArithmEval(buf, pos1 + 1, pos2, &result1))
-            return 0;
-        *result = !result1;
-        return 1;
+void exprNext(EXPRLEX *L) {
+    while ((L->pos < L->end) && isWhite(L->buf[L->pos]))
+        L->pos++;
+    L->tb = L->pos;
+    if (L->pos == L->end)
+        L->tok = EX_END;
+    else {
+        L->tok = exprOp(L, L->pos);
+        if (L->tok != EX_WORD)
+            L->pos += strlen(exprops[L->tok].s);
+        else
+            while ((L->pos < L->end) && !isWhite(L->buf[L->pos])
+                    && (exprOp(L, L->pos) == EX_WORD))
+                L->pos++;
     }
+    L->te = L->pos;
+}
 
-    if (buf[pos1] == '-') {
-        if (!DoArithmEval(buf, pos1 + 1, pos2, &result1))
-            return 0;
-        *result = -result1;
-        return 1;
+#define exprIs(L, op) (((L)->tok >= 0) && !strcmp(exprops[(L)->tok].s, (op)))
+
+/* <0, 0 or >0 as the text of x compares to that of y */
+int exprTextCmp(const EXPRLEX *L, const EXPRVAL *x, const EXPRVAL *y) {
+    int r, lx = x->e - x->b, ly = y->e - y->b;
+
+    r = strncmp(L->buf + x->b, L->buf + y->b, (lx < ly) ? lx : ly);
+    return r ? r : lx - ly;
+}
+
+#if HAVE_FNMATCH_H
+int exprGlob(const EXPRLEX *L, const EXPRVAL *x, const EXPRVAL *y) {
+    char *str1, *str2;
+
+    str1 = arenaStrdup(L->buf + x->b, x->e - x->b);
+    str2 = arenaStrdup(L->buf + y->b, y->e - y->b);
+    return (fnmatch(str2, str1, 0) == 0);
+}
+#endif
+
+/* a number on the left of || or && that settles it alone */
+#define exprDecides(x, op) ((x).ok && (((x).v != 0) == ((op) == '|')))
+
+EXPRVAL exprBinary(const EXPRLEX *L, const char *op, EXPRVAL x, EXPRVAL y) {
+    unsigned long long a = x.v, b = y.v;
+    int ok = x.ok && y.ok, cmp;
+
+    if (((op[0] == '|') || (op[0] == '&')) && (op[1] == op[0])
+            && exprDecides(x, op[0])) {
+        x.v = (op[0] == '|');
+        return x; /* whatever y is, as in C */
     }
+    /* the right side only counts once the left one is a number */
+    x.divzero = x.divzero || (x.ok && y.divzero);
+    if (!strcmp(op, "=~")) {
+#if ! HAVE_FNMATCH_H
+        bug("globbing support has not been compiled in");
+#else
+        x.v = ok ? (a == b) : exprGlob(L, &x, &y);
+#endif
+        x.ok = 1;
+        x.e = y.e;
+        return x;
+    }
+    if (strchr("=!<>", op[0])) { /* comparisons */
+        if (ok)
+            cmp = (x.v > y.v) - (x.v < y.v);
+        else
+            cmp = exprTextCmp(L, &x, &y);
+        x.e = y.e;
+        switch (op[0]) {
+        case '=':
+            x.v = (cmp == 0);
+            break;
+        case '!':
+            x.v = (cmp != 0);
+            break;
+        case '<':
+            x.v = op[1] ? (cmp <= 0) : (cmp < 0);
+            break;
+        default:
+            x.v = op[1] ? (cmp >= 0) : (cmp > 0);
+        }
+        x.ok = 1;
+        return x;
+    }
+    x.ok = ok;
+    x.e = y.e;
+    if (!ok)
+        return x;
+    switch (op[0]) {
+    case '|':
+        x.v = op[1] ? (x.v || y.v) : (long long) (a | b);
+        break;
+    case '&':
+        x.v = op[1] ? (x.v && y.v) : (long long) (a & b);
+        break;
+    case '^':
+        x.v = a ^ b;
+        break;
+    case '+':
+        x.v = a + b;
+        break;
+    case '-':
+        x.v = a - b;
+        break;
+    case '*':
+        x.v = a * b;
+        break;
+    default: /* '/' and '%' */
+        if (y.v == 0) {
+            x.divzero = 1;
+            x.ok = 0;
+        } else if (y.v == -1) /* no overflow on the smallest value */
+            x.v = (op[0] == '/') ? (long long) (0 - a) : 0;
+        else
+            x.v = (op[0] == '/') ? x.v / y.v : x.v % y.v;
+    }
+    return x;
+}
 
-    /* add the length() builtin to measure the length of the macro expansion */
-    if (strncmp(buf + pos1, "length(", strlen("length(")) == 0) {
-        if (buf[pos2 - 1] != ')')
-            return 0;
-        *result = pos2 - pos1 - strlen("length()");
-        return 1;
+EXPRVAL exprParse(EXPRLEX *L, int minprec);
+
+EXPRVAL exprPrimary(EXPRLEX *L) {
+    EXPRVAL x;
+    char *p;
+    int depth, b;
+
+    x.v = 0;
+    x.ok = 0;
+    x.divzero = 0;
+    x.b = x.e = L->tb;
+    if (L->tok == EX_WORD) {
+        x.e = L->te;
+        if ((L->te - L->tb == 6) && !strncmp(L->buf + L->tb, "length", 6)
+                && (L->te < L->end) && (L->buf[L->te] == '(')) {
+            /* length of the text up to the matching parenthesis */
+            for (depth = 0, p = (char *) L->buf + L->te; p < L->buf + L->end;
+                    p++) {
+                if (*p == '(')
+                    depth++;
+                else if ((*p == ')') && (--depth == 0))
+                    break;
+            }
+            if (p == L->buf + L->end) {
+                L->error = 1;
+                return x;
+            }
+            x.v = p - (L->buf + L->te + 1);
+            x.ok = 1;
+            x.e = p + 1 - L->buf;
+            L->pos = x.e;
+        } else {
+            x.v = strtoll(L->buf + L->tb, &p, 0);
+            x.ok = (p == L->buf + L->te);
+        }
+        exprNext(L);
+    } else if (exprIs(L, "(")) {
+        b = L->tb;
+        exprNext(L);
+        x = exprParse(L, 1);
+        if (!exprIs(L, ")"))
+            L->error = 1;
+        x.b = b;
+        x.e = L->te;
+        exprNext(L);
     }
+    /* else a missing operand, which is no number */
+    return x;
+}
 
-    if (buf[pos1] == '(') {
-        if (buf[pos2 - 1] != ')')
-            return 0;
-        return DoArithmEval(buf, pos1 + 1, pos2 - 1, result);
+EXPRVAL exprUnary(EXPRLEX *L) {
+    EXPRVAL x, y;
+    int b;
+    char op;
+
+    if (exprIs(L, "!") || exprIs(L, "~") || exprIs(L, "-") || exprIs(L, "+")) {
+        op = exprops[L->tok].s[0];
+        b = L->tb;
+        exprNext(L);
+        x = exprUnary(L);
+        x.b = b;
+        if (op == '!')
+            x.v = !x.v;
+        else if (op == '~')
+            x.v = ~x.v;
+        else if (op == '-')
+            x.v = (long long) (0 - (unsigned long long) x.v);
+        return x;
+    }
+    x = exprPrimary(L);
+    /* whatever follows without an operator in between makes it text */
+    while ((L->tok == EX_WORD) || exprIs(L, "(") || exprIs(L, "!")
+            || exprIs(L, "~")) {
+        y = exprUnary(L);
+        x.ok = 0;
+        x.divzero = 0;
+        x.e = y.e;
     }
+    return x;
+}
 
-    c = buf[pos2];
-    buf[pos2] = 0;
-    *result = (int) strtol(buf + pos1, &p, 0);
-    buf[pos2] = c;
-    return (p == buf + pos2);
+EXPRVAL exprParse(EXPRLEX *L, int minprec) {
+    EXPRVAL x, y;
+    int k;
+
+    x = exprUnary(L);
+    while ((L->tok >= 0) && (exprops[L->tok].prec >= minprec)
+            && !L->error) {
+        k = L->tok;
+        exprNext(L);
+        y = exprParse(L, exprops[k].prec + 1);
+        x = exprBinary(L, exprops[k].s, x, y);
+    }
+    return x;
 }
 
 void delete_macro(int i) {
     int j;
+    unindex_macro(i);
+    j = identFilterKey(macros[i].username, macros[i].namelen);
+    identfilter[j]--;
+    identgen[j]++;
     nmacros--;
     free(macros[i].username);
     free(macros[i].macrotext);
@@ -2072,46 +3867,254 @@ void delete_macro(int i) {
         free(macros[i].argnames);
         macros[i].argnames = NULL;
     }
-    FreeComments(macros[i].define_specs);
-    free(macros[i].define_specs);
-    memcpy(macros + i, macros + nmacros, sizeof(struct MACRO));
+    releaseSpecs(macros[i].define_specs);
+    releaseBody(macros[i].body);
+    if (i != nmacros) { /* the last macro moves into slot i */
+        macroindex[indexSlot(macros[nmacros].hash, macros[nmacros].username,
+                macros[nmacros].namelen)] = i;
+        memcpy(macros + i, macros + nmacros, sizeof(struct MACRO));
+    }
 }
 
-char *ArithmEval(int pos1, int pos2) {
+/* the operands of the top-level || and && of an expression in C->buf */
+#define MAX_EXPR_OPERANDS 64
+
+struct EXPROPERANDS {
+    int n;
+    int b[MAX_EXPR_OPERANDS], e[MAX_EXPR_OPERANDS];
+    char *text[MAX_EXPR_OPERANDS]; /* expansion, NULL until needed */
+};
+
+/* split [pos1, pos2) at the || and && outside of parentheses, comments
+   and macro arguments ; a single operand when it cannot be done */
+void splitExpression(struct EXPROPERANDS *X, int pos1, int pos2) {
+    int pos, depth;
+    char c;
+
+    X->n = 0;
+    X->b[0] = pos1;
+    depth = 0;
+    pos = pos1;
+    while (pos < pos2) {
+        SkipPossibleComments(&pos, FLAG_META, 0);
+        if (pos >= pos2)
+            break;
+        c = C->buf[pos];
+        if ((c == S->User.quotechar) && (pos + 1 < pos2)) {
+            pos += 2;
+            continue;
+        }
+        if ((c == '(') || (charFlags(c) & (CH_STACK | CH_MSTACK)))
+            depth++;
+        else if ((c == ')') || (charFlags(c) & (CH_UNSTACK | CH_MUNSTACK))) {
+            if (--depth < 0)
+                break;
+        } else if ((depth == 0) && ((c == '|') || (c == '&'))
+                && (pos + 1 < pos2) && (C->buf[pos + 1] == c)) {
+            if (X->n + 1 == MAX_EXPR_OPERANDS)
+                break;
+            X->e[X->n++] = pos;
+            pos += 2;
+            X->b[X->n] = pos;
+            continue;
+        }
+        pos++;
+    }
+    if ((pos != pos2) || (depth != 0))
+        X->n = 0; /* unbalanced, keep it whole */
+    X->e[X->n] = pos2;
+    X->n++;
+}
+
+char *expandOperand(struct EXPROPERANDS *X, int i) {
+    if (X->text[i] == NULL) {
+        definedop++;
+        X->text[i] = ProcessText(C->buf + X->b[i], X->e[i] - X->b[i],
+                FLAG_META);
+        definedop--;
+    }
+    return X->text[i];
+}
+
+/* an operand holding || or && of its own once expanded does not stand
+   alone : *error asks for the whole expression instead */
+EXPRVAL evalOperand(struct EXPROPERANDS *X, int i, int *error) {
+    EXPRLEX L;
+    EXPRVAL x;
+
+    L.buf = expandOperand(X, i);
+    L.pos = 0;
+    L.end = strlen(L.buf);
+    L.error = 0;
+    exprNext(&L);
+    x = exprParse(&L, (X->n == 1) ? 1 : 3);
+    if (L.error || (L.tok != EX_END))
+        *error = 1;
+    return x;
+}
+
+/* the expansion of the whole expression */
+char *joinOperands(struct EXPROPERANDS *X) {
     char *s, *t;
-    int i;
+    int i, l;
 
-    /* first define the defined(...) operator */
-    i = findIdent("defined", strlen("defined"));
-    if (i >= 0)
-        warning("the defined(...) macro is already defined");
-    else {
-        newmacro("defined", strlen("defined"), 1);
-        macros[nmacros].macrolen = 0;
-        macros[nmacros].macrotext = malloc(1);
-        macros[nmacros].macrotext[0] = 0;
-        macros[nmacros].nnamedargs = -2; /* trademark of the defined(...) macro */
-        nmacros++;
-    }
-    /* process the text in a usual way */
-    s = ProcessText(C->buf + pos1, pos2 - pos1, FLAG_META);
-    /* undefine the defined(...) operator */
-    if (i < 0) {
-        i = findIdent("defined", strlen("defined"));
-        if ((i < 0) || (macros[i].nnamedargs != -2))
-            warning("the defined(...) macro was redefined in expression");
-        else
-            delete_macro(i);
+    if (X->n == 1)
+        return expandOperand(X, 0);
+    for (l = i = 0; i < X->n; i++)
+        l += strlen(expandOperand(X, i)) + 2;
+    t = s = arenaAlloc(l);
+    for (i = 0; i < X->n; i++) {
+        if (i > 0) {
+            memcpy(t, C->buf + X->e[i - 1], 2);
+            t += 2;
+        }
+        strcpy(t, X->text[i]);
+        t += strlen(t);
     }
+    return s;
+}
+
+/* operands of || and && are expanded one at a time, and not at all once
+   the result is known */
+char *ArithmEval(int pos1, int pos2) {
+    struct EXPROPERANDS X;
+    EXPRLEX L;
+    EXPRVAL acc, grp, y;
+    char *t;
+    int i, error;
 
-    if (!DoArithmEval(s, 0, strlen(s), &i))
-        return s; /* couldn't compute */
-    t = malloc(MAX_GPP_NUM_SIZE);
-    sprintf(t, "%d", i);
-    free(s);
+    if (findIdent("defined", strlen("defined")) >= 0)
+        warning("the defined(...) macro is already defined");
+    splitExpression(&X, pos1, pos2);
+    for (i = 0; i < X.n; i++)
+        X.text[i] = NULL;
+    error = 0;
+    grp = evalOperand(&X, 0, &error);
+    acc.v = 0;
+    acc.ok = 1;
+    acc.divzero = 0;
+    for (i = 1; (i < X.n) && !error; i++) {
+        if (C->buf[X.e[i - 1]] == '|') {
+            acc = exprBinary(NULL, "||", acc, grp);
+            if (exprDecides(acc, '|'))
+                break;
+            grp = evalOperand(&X, i, &error);
+        } else if (!exprDecides(grp, '&')) {
+            y = evalOperand(&X, i, &error);
+            grp = exprBinary(NULL, "&&", grp, y);
+        }
+    }
+    if (i == X.n) /* else the rest was skipped */
+        acc = (X.n == 1) ? grp : exprBinary(NULL, "||", acc, grp);
+    if (error && (X.n > 1)) { /* the operands do not stand alone */
+        L.buf = joinOperands(&X);
+        L.pos = 0;
+        L.end = strlen(L.buf);
+        L.error = 0;
+        exprNext(&L);
+        acc = exprParse(&L, 1);
+        error = L.error || (L.tok != EX_END);
+    }
+    if (acc.divzero)
+        bug("Division by zero in expression");
+    if (error || !acc.ok)
+        return joinOperands(&X); /* couldn't compute */
+    t = arenaAlloc(MAX_GPP_NUM_SIZE);
+    sprintf(t, "%lld", acc.v);
     return t;
 }
 
+int depsValid(const struct IFDEPS *D) {
+    int i;
+
+    for (i = 0; i < D->n; i++)
+        if (identgen[D->key[i]] != D->gen[i])
+            return 0;
+    return 1;
+}
+
+/* whether the #if condition in [pos1, pos2) holds */
+/* the entry for C->buf[pos1..pos2) in bucket h, moved to the front ;
+   else NULL, and *last is the link to the last entry of a full chain */
+static struct IFCACHE *findCondition(int h, int pos1, int pos2,
+        struct IFCACHE ***last) {
+    struct IFCACHE *E, **q;
+    int n;
+
+    *last = NULL;
+    for (q = &ifcache[h], n = 0; (E = *q) != NULL; q = &E->next, n++) {
+        if ((E->len == pos2 - pos1)
+                && !memcmp(E->text, C->buf + pos1, E->len)
+                && ((E->specs == S) || ((E->specs->hash == S->hash)
+                        && sameSpecs(E->specs, S)))) {
+            *q = E->next;
+            E->next = ifcache[h];
+            ifcache[h] = E;
+            return E;
+        }
+        if (n + 1 >= IFCACHE_CHAIN)
+            *last = q;
+    }
+    return NULL;
+}
+
+int evalCondition(int pos1, int pos2) {
+    struct IFCACHE *E, **last;
+    struct IFDEPS D;
+    char *s;
+    int h, calls, cacheable, result;
+
+    while ((pos1 < pos2) && isWhite(C->buf[pos1]))
+        pos1++;
+    while ((pos2 > pos1) && isWhite(C->buf[pos2 - 1]))
+        pos2--;
+    h = hashIdent(C->buf + pos1, pos2 - pos1) & (IFCACHE_SIZE - 1);
+    E = findCondition(h, pos1, pos2, &last);
+    /* an include being recorded has to see the lookups */
+    if ((E != NULL) && !recordings && depsValid(&E->deps)) {
+        ifhits++;
+        return E->result;
+    }
+    ifmisses++;
+
+    /* no telling what a macro argument or a meta-macro depends on */
+    cacheable = (C->args == NULL) && (C->namedargs == NULL) && (ifdeps == NULL);
+    if (cacheable) {
+        D.n = 0;
+        ifdeps = &D;
+    }
+    calls = metacalls;
+    s = ArithmEval(pos1, pos2);
+    result = !((s[0] == '0') && (s[1] == 0));
+    if (!cacheable)
+        return result;
+    ifdeps = NULL;
+    if ((D.n < 0) || (metacalls != calls))
+        return result;
+    /* the evaluation may have changed the chain */
+    E = findCondition(h, pos1, pos2, &last);
+    if (E == NULL) {
+        if (last != NULL) { /* reuse the least recently used one */
+            E = *last;
+            *last = NULL;
+            free(E->text);
+            releaseSpecs(E->specs);
+        } else if ((E = malloc(sizeof *E)) == NULL)
+            bug("Out of memory");
+        E->text = malloc(pos2 - pos1 + 1);
+        if (E->text == NULL)
+            bug("Out of memory");
+        memcpy(E->text, C->buf + pos1, pos2 - pos1);
+        E->len = pos2 - pos1;
+        E->specs = shareSpecs(S);
+        E->next = ifcache[h];
+        ifcache[h] = E;
+    }
+    E->result = result;
+    E->deps = D;
+    return result;
+}
+
 int comment_or_white(int start, int end, int cmtmode) {
     char c;
 
@@ -2145,9 +4148,10 @@ char *remove_comments(int start, int end, int cmtmode) {
 }
 
 void SetStandardMode(struct SPECS *P, const char *opt) {
-    P->op_set = DefaultOp;
-    P->ext_op_set = DefaultExtOp;
-    P->id_set = DefaultId;
+    modechanges++;
+    setCharset(P, CH_OP, DEFAULT_OP_STRING);
+    setCharset(P, CH_OPX, DEFAULT_OP_PLUS);
+    setCharset(P, CH_ID, DEFAULT_ID_STRING);
     FreeComments(P);
     if (!strcmp(opt, "C") || !strcmp(opt, "cpp")) {
         P->User = KUser;
@@ -2178,7 +4182,7 @@ void SetStandardMode(struct SPECS *P, const char *opt) {
         P->User = KUser;
         P->Meta = KMeta;
         P->preservelf = 1;
-        P->op_set = PrologOp;
+        setCharset(P, CH_OP, PROLOG_OP_STRING);
         add_comment(P, "css", my_strdup("\213/*"), my_strdup("*/"), 0, 0); /* \!o */
         add_comment(P, "cii", my_strdup("\\\n"), my_strdup(""), 0, 0);
         add_comment(P, "css", my_strdup("%"), my_strdup("\n"), 0, 0);
@@ -2186,19 +4190,23 @@ void SetStandardMode(struct SPECS *P, const char *opt) {
         add_comment(P, "sss", my_strdup("\207'"), my_strdup("'"), 0, '\n'); /* \!# */
     } else
         bug("unknown standard mode");
+    buildSpecsTables(P);
 }
 
 void ProcessModeCommand(int p1start, int p1end, int p2start, int p2end) {
+    struct SPECSTACK *L, *N;
     struct SPECS *P;
     char *s, *p, *opt;
     int nargs, check_isdelim;
     char *args[10]; /* can't have more than 10 arguments */
 
+    modechanges++;
+
     whiteout(&p1start, &p1end);
     if ((p1start == p1end) || (identifierEnd(p1start) != p1end))
         bug("invalid #mode syntax");
     if (p2start < 0)
-        s = my_strdup("");
+        s = arenaStrdup("", 0);
     else
         s = ProcessText(C->buf + p2start, p2end - p2start, FLAG_META);
 
@@ -2230,12 +4238,41 @@ void ProcessModeCommand(int p1start, int p1end, int p2start, int p2end) {
             p++;
     }
 
+    /* the changes go to the level under the one pushed for the command */
+    L = specstack->next;
+    if (idequal(C->buf + p1start, p1end - p1start, "save")
+            || idequal(C->buf + p1start, p1end - p1start, "push")) {
+        if ((opt != NULL )||nargs)
+            bug("too many arguments to #mode save");
+        N = malloc(sizeof *N);
+        if (N == NULL )
+            bug("Out of memory.");
+        N->specs = shareSpecs(L->specs);
+        N->next = L;
+        specstack->next = N;
+        return;
+    }
+    if (idequal(C->buf + p1start, p1end - p1start, "restore")
+            || idequal(C->buf + p1start, p1end - p1start, "pop")) {
+        if ((opt != NULL )||nargs)
+            bug("too many arguments to #mode restore");
+        if (L->next == NULL )
+            bug("#mode restore without #mode save");
+        if (recordings)
+            notePop(L);
+        specstack->next = L->next;
+        releaseSpecs(L->specs);
+        free(L);
+        return;
+    }
+
+    P = writableSpecs(L);
     if (idequal(C->buf + p1start, p1end - p1start, "quote")) {
         if (opt || (nargs > 1))
             bug("syntax error in #mode quote command");
         if (nargs == 0)
             args[0] = "";
-        S->stack_next->User.quotechar = args[0][0];
+        P->User.quotechar = args[0][0];
     } else if (idequal(C->buf + p1start, p1end - p1start, "comment")) {
         if ((nargs < 2) || (nargs > 4))
             bug("syntax error in #mode comment command");
@@ -2245,7 +4282,7 @@ void ProcessModeCommand(int p1start, int p1end, int p2start, int p2end) {
             args[2] = "";
         if (nargs < 4)
             args[3] = "";
-        add_comment(S->stack_next, opt, my_strdup(args[0]), my_strdup(args[1]),
+        add_comment(P, opt, my_strdup(args[0]), my_strdup(args[1]),
                 args[2][0], args[3][0]);
     } else if (idequal(C->buf + p1start, p1end - p1start, "string")) {
         if ((nargs < 2) || (nargs > 4))
@@ -2256,159 +4293,838 @@ void ProcessModeCommand(int p1start, int p1end, int p2start, int p2end) {
             args[2] = "";
         if (nargs < 4)
             args[3] = "";
-        add_comment(S->stack_next, opt, my_strdup(args[0]), my_strdup(args[1]),
+        add_comment(P, opt, my_strdup(args[0]), my_strdup(args[1]),
                 args[2][0], args[3][0]);
-    } else if (idequal(C->buf + p1start, p1end - p1start, "save")
-            || idequal(C->buf + p1start, p1end - p1start, "push")) {
-        if ((opt != NULL )||nargs)
-            bug("too many arguments to #mode save");
-        P = CloneSpecs(S->stack_next);
-        P->stack_next = S->stack_next;
-        S->stack_next = P;
-    } else if (idequal(C->buf + p1start, p1end - p1start, "restore")
-            || idequal(C->buf + p1start, p1end - p1start, "pop")) {
-        if ((opt != NULL )||nargs)
-            bug("too many arguments to #mode restore");
-        P = S->stack_next->stack_next;
-        if (P == NULL )
-            bug("#mode restore without #mode save");
-        FreeComments(S->stack_next);
-        free(S->stack_next);
-        S->stack_next = P;
     } else if (idequal(C->buf + p1start, p1end - p1start, "standard")) {
         if ((opt == NULL )||nargs)
             bug("syntax error in #mode standard");
-        SetStandardMode(S->stack_next, opt);
+        SetStandardMode(P, opt);
     } else if (idequal(C->buf + p1start, p1end - p1start, "user")) {
         if ((opt != NULL )||(nargs!=9))bug("#mode user requires 9 arguments");
-        S->stack_next->User.mStart=my_strdup(args[0]);
-        S->stack_next->User.mEnd=my_strdup(args[1]);
-        S->stack_next->User.mArgS=my_strdup(args[2]);
-        S->stack_next->User.mArgSep=my_strdup(args[3]);
-        S->stack_next->User.mArgE=my_strdup(args[4]);
-        S->stack_next->User.stackchar=my_strdup(args[5]);
-        S->stack_next->User.unstackchar=my_strdup(args[6]);
-        S->stack_next->User.mArgRef=my_strdup(args[7]);
-        S->stack_next->User.quotechar=args[8][0];
+        P->User.mStart=my_strdup(args[0]);
+        P->User.mEnd=my_strdup(args[1]);
+        P->User.mArgS=my_strdup(args[2]);
+        P->User.mArgSep=my_strdup(args[3]);
+        P->User.mArgE=my_strdup(args[4]);
+        P->User.stackchar=my_strdup(args[5]);
+        P->User.unstackchar=my_strdup(args[6]);
+        P->User.mArgRef=my_strdup(args[7]);
+        P->User.quotechar=args[8][0];
     }
     else if (idequal(C->buf+p1start,p1end-p1start,"meta")) {
         if ((opt!=NULL)&&!nargs&&!strcmp(opt,"user"))
-        S->stack_next->Meta=S->stack_next->User;
+        P->Meta=P->User;
         else {
             if ((opt!=NULL)||(nargs!=7)) bug("#mode meta requires 7 arguments");
-            S->stack_next->Meta.mStart=my_strdup(args[0]);
-            S->stack_next->Meta.mEnd=my_strdup(args[1]);
-            S->stack_next->Meta.mArgS=my_strdup(args[2]);
-            S->stack_next->Meta.mArgSep=my_strdup(args[3]);
-            S->stack_next->Meta.mArgE=my_strdup(args[4]);
-            S->stack_next->Meta.stackchar=my_strdup(args[5]);
-            S->stack_next->Meta.unstackchar=my_strdup(args[6]);
+            P->Meta.mStart=my_strdup(args[0]);
+            P->Meta.mEnd=my_strdup(args[1]);
+            P->Meta.mArgS=my_strdup(args[2]);
+            P->Meta.mArgSep=my_strdup(args[3]);
+            P->Meta.mArgE=my_strdup(args[4]);
+            P->Meta.stackchar=my_strdup(args[5]);
+            P->Meta.unstackchar=my_strdup(args[6]);
         }
     }
     else if (idequal(C->buf+p1start,p1end-p1start,"preservelf")) {
         if ((opt==NULL)||nargs) bug("syntax error in #mode preservelf");
-        if (!strcmp(opt,"1")||!my_strcasecmp(opt,"on")) S->stack_next->preservelf=1;
-        else if (!strcmp(opt,"0")||!my_strcasecmp(opt,"off")) S->stack_next->preservelf=0;
+        if (!strcmp(opt,"1")||!my_strcasecmp(opt,"on")) P->preservelf=1;
+        else if (!strcmp(opt,"0")||!my_strcasecmp(opt,"off")) P->preservelf=0;
         else bug("#mode preservelf requires on/off argument");
     }
     else if (idequal(C->buf+p1start,p1end-p1start,"nocomment")
             ||idequal(C->buf+p1start,p1end-p1start,"nostring")) {
         if ((opt!=NULL)||(nargs>1))
         bug("syntax error in #mode nocomment/nostring");
-        if (nargs==0) FreeComments(S->stack_next);
-        else delete_comment(S->stack_next,my_strdup(args[0]));
+        if (nargs==0) FreeComments(P);
+        else delete_comment(P,my_strdup(args[0]));
     }
     else if (idequal(C->buf+p1start,p1end-p1start,"charset")) {
         if ((opt==NULL)||(nargs!=1)) bug("syntax error in #mode charset");
         if (!my_strcasecmp(opt,"op"))
-        S->stack_next->op_set=MakeCharsetSubset((unsigned char *)args[0]);
+        setCharset(P,CH_OP,(unsigned char *)args[0]);
         else if (!my_strcasecmp(opt,"par"))
-        S->stack_next->ext_op_set=MakeCharsetSubset((unsigned char *)args[0]);
+        setCharset(P,CH_OPX,(unsigned char *)args[0]);
         else if (!my_strcasecmp(opt,"id"))
-        S->stack_next->id_set=MakeCharsetSubset((unsigned char *)args[0]);
+        setCharset(P,CH_ID,(unsigned char *)args[0]);
         else bug("unknown charset subset name in #mode charset");
     }
     else bug("unrecognized #mode command");
-
-    free(s);
+    buildSpecsTables(P);
+    L->specs = internSpecs(P);
 }
 
-static void DoInclude(char *file_name, int ignore_nonexistent) {
-    struct INPUTCONTEXT *N;
-    char *incfile_name = NULL;
-    FILE *f = NULL;
-    int j;
-    int len = strlen(file_name);
+/* look for file_name the way #include does ; *path is what was opened */
+static struct INPUTFILE *searchInclude(const char *file_name, char **path) {
+    struct INPUTFILE *f = NULL;
+    char *incfile_name;
+    int j, l, len = strlen(file_name);
 
     /* if absolute path name is specified */
     if (file_name[0] == SLASH
 #ifdef WIN_NT
     || (isalpha(file_name[0]) && file_name[1]==':')
 #endif
-    )
-        f = fopen(file_name, "r");
-    else /* search current dir, if this search isn't turned off */
-    if (!NoCurIncFirst) {
-        f = openInCurrentDir(file_name);
+    ) {
+        f = openIncluded(file_name);
+        if (f != NULL)
+            *path = my_strdup(file_name);
+    } else /* search current dir, if this search isn't turned off */
+    if (!NoCurIncFirst)
+        f = openInCurrentDir(file_name, path);
+
+    for (j = 0, l = 0; j < nincludedirs; j++)
+        if ((int) strlen(includedir[j]) > l)
+            l = strlen(includedir[j]);
+    incfile_name = malloc(l + len + 2);
+    if (incfile_name == NULL)
+        bug("Out of memory");
+    for (j = 0; (f == NULL) && (j < nincludedirs); j++) {
+        l = strlen(includedir[j]);
+        memcpy(incfile_name, includedir[j], l);
+        incfile_name[l] = SLASH;
+        /* extract the orig include filename */
+        strcpy(incfile_name + l + 1, file_name);
+        f = openIncluded(incfile_name);
+        if (f != NULL) {
+            *path = incfile_name;
+            incfile_name = NULL;
+        }
     }
+    free(incfile_name);
 
-    for (j = 0; (f == NULL )&&(j<nincludedirs);j++){
-    incfile_name =
-    realloc(incfile_name,len+strlen(includedir[j])+2);
-    strcpy(incfile_name,includedir[j]);
-    incfile_name[strlen(includedir[j])]=SLASH;
-    /* extract the orig include filename */
-    strcpy(incfile_name+strlen(includedir[j])+1, file_name);
-    f=fopen(incfile_name,"r");
+    /* If didn't find the file and "." is said to be searched last */
+    if (f == NULL && CurDirIncLast)
+        f = openInCurrentDir(file_name, path);
+    return f;
 }
-    if (incfile_name != NULL )
-        free(incfile_name);
 
-    /* If didn't find the file and "." is said to be searched last */
-    if (f == NULL && CurDirIncLast) {
-        f = openInCurrentDir(file_name);
+/* the search depends on the directory of the including file only */
+static int includeDirLen(void) {
+    int i;
+
+    if (IncludeFile)
+        return 0;
+    for (i = strlen(C->filename) - 1; (i >= 0) && (C->filename[i] != SLASH);
+            i--)
+        ;
+    return i + 1;
+}
+
+/* searchInclude(), remembering the outcome ; #exec may create files */
+/* the outcome of earlier searches for file_name, or a new entry */
+static struct INCCACHE *includeEntry(const char *file_name) {
+    struct INCCACHE *E;
+    int l = includeDirLen(), h;
+
+    h = (hashIdent(C->filename, l) ^ hashIdent(file_name, strlen(file_name)))
+            & (INCCACHE_SIZE - 1);
+    for (E = inccache[h]; E != NULL; E = E->next)
+        if (!strcmp(E->name, file_name) && ((int) strlen(E->dir) == l)
+                && !strncmp(E->dir, C->filename, l))
+            return E;
+    E = malloc(sizeof *E);
+    if (E == NULL)
+        bug("Out of memory");
+    E->dir = malloc(l + 1);
+    if (E->dir == NULL)
+        bug("Out of memory");
+    memcpy(E->dir, C->filename, l);
+    E->dir[l] = 0;
+    E->name = my_strdup(file_name);
+    E->path = NULL;
+    E->searched = 0;
+    E->known = 0;
+    E->canon = NULL;
+    E->next = inccache[h];
+    inccache[h] = E;
+    return E;
+}
+
+/* note which file E->path is, whatever the way it was spelled */
+static void noteFileId(struct INCCACHE *E) {
+    struct FILESIG F;
+#ifdef WIN_NT
+    char *p;
+#endif
+
+    /* Windows gives every file the inode 0 */
+    E->known = fileSig(E->path, &F) && (F.ino != 0);
+    if (E->known) {
+        E->dev = F.dev;
+        E->ino = F.ino;
+        return;
+    }
+    free(E->canon);
+#ifdef WIN_NT
+    E->canon = _fullpath(NULL, E->path, _MAX_PATH);
+    if (E->canon == NULL)
+#endif
+        E->canon = my_strdup(E->path);
+    if (E->canon == NULL)
+        bug("Out of memory");
+#ifdef WIN_NT
+    for (p = E->canon; *p != 0; p++) {
+        *p = tolower((unsigned char) *p);
+        if (*p == '/')
+            *p = SLASH;
+    }
+#endif
+}
+
+/* searchInclude(), unless E already tells where file_name is */
+static struct INPUTFILE *openInclude(struct INCCACHE *E,
+        const char *file_name) {
+    struct INPUTFILE *f;
+
+    if (E->searched) {
+        if (E->path == NULL) {
+            inchits++;
+            return NULL;
+        }
+        if ((f = openIncluded(E->path)) != NULL) {
+            inchits++;
+            noteFileId(E);
+            return f;
+        }
+        free(E->path); /* gone since, look again */
+        E->path = NULL;
+    }
+    incmisses++;
+    f = searchInclude(file_name, &E->path);
+    E->searched = 1;
+    if (f != NULL)
+        noteFileId(E);
+    return f;
+}
+
+void clearIncludeCache(void) {
+    struct INCCACHE *E;
+    int h;
+
+    for (h = 0; h < INCCACHE_SIZE; h++)
+        while ((E = inccache[h]) != NULL) {
+            inccache[h] = E->next;
+            free(E->dir);
+            free(E->name);
+            free(E->path);
+            free(E->canon);
+            free(E);
+        }
+}
+
+/* a copy of macro m, that stays as it is */
+struct MACRO *copyMacro(const struct MACRO *m) {
+    struct MACRO *n;
+    int j;
+
+    n = malloc(sizeof *n);
+    if (n == NULL)
+        bug("Out of memory");
+    memcpy(n, m, sizeof *n);
+    n->username = my_strdup(m->username);
+    n->macrotext = my_strdup(m->macrotext);
+    if (m->argnames != NULL) {
+        n->argnames = malloc((m->nnamedargs + 1) * sizeof(char *));
+        if (n->argnames == NULL)
+            bug("Out of memory");
+        for (j = 0; j < m->nnamedargs; j++)
+            n->argnames[j] = my_strdup(m->argnames[j]);
+        n->argnames[j] = NULL;
+    }
+    if (n->define_specs != NULL)
+        shareSpecs(n->define_specs);
+    if (n->body != NULL)
+        n->body->refs++;
+    return n;
+}
+
+void freeMacro(struct MACRO *m) {
+    int j;
+
+    if (m == NULL)
+        return;
+    free(m->username);
+    free(m->macrotext);
+    if (m->argnames != NULL) {
+        for (j = 0; j < m->nnamedargs; j++)
+            free(m->argnames[j]);
+        free(m->argnames);
+    }
+    releaseSpecs(m->define_specs);
+    releaseBody(m->body);
+    free(m);
+}
+
+/* whether macros m and n, either NULL if undefined, expand the same */
+int sameMacro(const struct MACRO *m, const struct MACRO *n) {
+    int j;
+
+    if ((m == NULL) || (n == NULL))
+        return m == n;
+    if ((m->macrolen != n->macrolen) || strcmp(m->macrotext, n->macrotext)
+            || (m->nnamedargs != n->nnamedargs)
+            || ((m->argnames == NULL) != (n->argnames == NULL))
+            || (m->defined_in_comment != n->defined_in_comment))
+        return 0;
+    for (j = 0; j < m->nnamedargs; j++)
+        if (strcmp(m->argnames[j], n->argnames[j]))
+            return 0;
+    if (m->define_specs == n->define_specs)
+        return 1;
+    return (m->define_specs != NULL) && (n->define_specs != NULL)
+            && (m->define_specs->hash == n->define_specs->hash)
+            && sameSpecs(m->define_specs, n->define_specs);
+}
+
+/* what the file cache tells files apart by */
+int fileSig(const char *path, struct FILESIG *F) {
+    struct stat st;
+
+    if ((stat(path, &st) != 0) || !S_ISREG(st.st_mode))
+        return 0;
+    F->dev = st.st_dev;
+    F->ino = st.st_ino;
+    F->size = st.st_size;
+    F->mtime = st.st_mtime;
+    return 1;
+}
+
+void freeReplay(struct REPLAY *R) {
+    int i;
+
+    if (R == NULL)
+        return;
+    for (i = 0; i < R->nnames; i++) {
+        free(R->names[i].name);
+        freeMacro(R->names[i].before);
+        freeMacro(R->names[i].after);
+    }
+    for (i = 0; i < R->nfiles; i++)
+        free(R->files[i].path);
+    free(R->names);
+    free(R->files);
+    free(R->out);
+    free(R->filename);
+    releaseSpecs(R->specs);
+    free(R);
+}
+
+void stopRecording(struct REPLAY *R) {
+    if (R->valid) {
+        R->valid = 0;
+        recordings--;
+    }
+}
+
+void stopRecordings(void) {
+    struct REPLAY *R;
+
+    for (R = recording; R != NULL; R = R->outer)
+        stopRecording(R);
+}
+
+/* the entry of name b in R, added if new ; NULL if R is full */
+struct REPLAYNAME *replayName(struct REPLAY *R, const char *b, int l,
+        unsigned int h) {
+    struct REPLAYNAME *n;
+    int i;
+
+    for (i = 0; i < R->nnames; i++) {
+        n = R->names + i;
+        if ((n->hash == h) && (n->len == l) && !memcmp(n->name, b, l))
+            return n;
+    }
+    if (R->nnames == REPLAY_NAMES)
+        return NULL;
+    if (R->nnames == R->namesalloced) {
+        R->namesalloced = 2 * R->namesalloced + 16;
+        R->names = realloc(R->names, R->namesalloced * sizeof *R->names);
+        if (R->names == NULL)
+            bug("Out of memory");
+    }
+    n = R->names + R->nnames++;
+    n->name = malloc(l + 1);
+    if (n->name == NULL)
+        bug("Out of memory");
+    memcpy(n->name, b, l);
+    n->name[l] = 0;
+    n->len = l;
+    n->hash = h;
+    n->flags = 0;
+    n->before = n->after = NULL;
+    return n;
+}
+
+/* name b is looked up : unless they set it themselves, what the files
+   being recorded do depends on what it stands for now */
+void noteLookup(const char *b, int l) {
+    struct REPLAY *R;
+    struct REPLAYNAME *n;
+    unsigned int h = hashIdent(b, l);
+    int i;
+
+    for (R = recording; R != NULL; R = R->outer) {
+        if (!R->valid)
+            continue;
+        n = replayName(R, b, l, h);
+        if (n == NULL)
+            stopRecording(R);
+        else if (n->flags == 0) {
+            n->flags = NAME_LOOKED;
+            i = lookupIdent(b, l);
+            if (i >= 0)
+                n->before = copyMacro(macros + i);
+        }
+    }
+}
+
+/* name b is about to be defined or undefined */
+void noteTouch(const char *b, int l) {
+    struct REPLAY *R;
+    struct REPLAYNAME *n;
+    unsigned int h = hashIdent(b, l);
+
+    for (R = recording; R != NULL; R = R->outer) {
+        if (!R->valid)
+            continue;
+        n = replayName(R, b, l, h);
+        if (n == NULL)
+            stopRecording(R);
+        else
+            n->flags |= NAME_TOUCHED;
+    }
+}
+
+void noteFile(const struct FILESIG *F) {
+    struct REPLAY *R;
+    int i;
+
+    for (R = recording; R != NULL; R = R->outer) {
+        if (!R->valid)
+            continue;
+        for (i = 0; (i < R->nfiles) && strcmp(R->files[i].path, F->path); i++)
+            ;
+        if (i < R->nfiles)
+            continue;
+        if (R->nfiles == R->filesalloced) {
+            R->filesalloced = 2 * R->filesalloced + 4;
+            R->files = realloc(R->files, R->filesalloced * sizeof *R->files);
+            if (R->files == NULL)
+                bug("Out of memory");
+        }
+        R->files[R->nfiles] = *F;
+        R->files[R->nfiles++].path = my_strdup(F->path);
+    }
+}
+
+/* what the files being recorded print : blanks, or they are not */
+void recordOutput(const char *s, int l) {
+    struct REPLAY *R;
+    int i;
+
+    for (R = recording; R != NULL; R = R->outer) {
+        if (!R->valid || (C->out != R->ctx->out))
+            continue;
+        for (i = 0; (i < l) && isWhite(s[i]); i++)
+            ;
+        if ((i < l) || (R->outlen + l > REPLAY_OUT_MAX)) {
+            stopRecording(R);
+            continue;
+        }
+        if (R->outlen + l > R->outalloced) {
+            while (R->outlen + l > R->outalloced)
+                R->outalloced = 2 * R->outalloced + 64;
+            R->out = realloc(R->out, R->outalloced);
+            if (R->out == NULL)
+                bug("Out of memory");
+        }
+        memcpy(R->out + R->outlen, s, l);
+        R->outlen += l;
     }
+}
+
+/* an #else, #elif or #endif acts on iflevel */
+void noteIfLevel(void) {
+    struct REPLAY *R;
+
+    for (R = recording; R != NULL; R = R->outer)
+        if (iflevel <= R->level)
+            stopRecording(R); /* that of an including file */
+}
+
+/* a #mode pop takes away stack level L */
+void notePop(const struct SPECSTACK *L) {
+    struct REPLAY *R;
+
+    for (R = recording; R != NULL; R = R->outer)
+        if (L->next == R->base)
+            stopRecording(R);
+}
+
+/* start recording the file at path, opened for an include in context C */
+struct REPLAY *startRecording(const char *path, char *file_name) {
+    struct REPLAY *R;
+    struct FILESIG F;
+
+    if ((include_directive_marker != NULL) || definedop
+            || !fileSig(path, &F)) {
+        stopRecordings(); /* they could not be done again either */
+        return NULL;
+    }
+    F.path = (char *) path;
+    R = malloc(sizeof *R);
+    if (R == NULL)
+        bug("Out of memory");
+    memset(R, 0, sizeof *R);
+    R->filename = my_strdup(file_name);
+    R->specs = shareSpecs(S);
+    R->valid = 1;
+    R->ctx = C;
+    R->base = specstack;
+    R->basespecs = S;
+    R->level = iflevel;
+    R->execs = execs;
+    R->outer = recording;
+    recording = R;
+    recordings++;
+    noteFile(&F);
+    return R;
+}
+
+/* the file of R is done ; keep R in G if it can be done again */
+void endRecording(struct REPLAY *R, struct INCGUARD *G) {
+    struct REPLAYNAME *n;
+    int i, j;
+
+    recording = R->outer;
+    if (R->valid) {
+        recordings--;
+        if ((iflevel == R->level) && (execs == R->execs)
+                && (specstack->next == R->base)
+                && (R->base->specs == R->basespecs)) {
+            for (i = 0; i < R->nnames; i++) {
+                n = R->names + i;
+                if (n->flags & NAME_TOUCHED) {
+                    j = lookupIdent(n->name, n->len);
+                    if (j >= 0)
+                        n->after = copyMacro(macros + j);
+                }
+            }
+            R->ctx = NULL;
+            R->base = NULL;
+            R->basespecs = NULL;
+            R->outer = NULL;
+            freeReplay(G->replay);
+            G->replay = R;
+            return;
+        }
+    }
+    freeReplay(R);
+}
+
+/* including the file of R, under file_name, would do what R did */
+int replayHolds(const struct REPLAY *R, const char *file_name) {
+    struct FILESIG F;
+    struct REPLAYNAME *n;
+    int i, j;
+
+    if ((include_directive_marker != NULL) || definedop
+            || strcmp(R->filename, file_name)
+            || ((R->specs != S) && ((R->specs->hash != S->hash)
+                    || !sameSpecs(R->specs, S))))
+        return 0;
+    for (i = 0; i < R->nnames; i++) {
+        n = R->names + i;
+        if (n->flags & NAME_LOOKED) {
+            j = findIdent(n->name, n->len);
+            if (!sameMacro(n->before, (j >= 0) ? macros + j : NULL))
+                return 0;
+        }
+    }
+    for (i = 0; i < R->nfiles; i++)
+        if (!fileSig(R->files[i].path, &F) || (F.dev != R->files[i].dev)
+                || (F.ino != R->files[i].ino) || (F.size != R->files[i].size)
+                || (F.mtime != R->files[i].mtime))
+            return 0;
+    return 1;
+}
+
+void replayInclude(const struct REPLAY *R) {
+    struct REPLAYNAME *n;
+    struct MACRO *m;
+    int i, j, k;
+
+    for (i = 0; i < R->nfiles; i++)
+        noteFile(R->files + i);
+    for (i = 0; i < R->nnames; i++) {
+        n = R->names + i;
+        if (!(n->flags & NAME_TOUCHED))
+            continue;
+        if (recordings)
+            noteTouch(n->name, n->len);
+        j = lookupIdent(n->name, n->len);
+        if ((j >= 0) && sameMacro(macros + j, n->after))
+            continue;
+        if (j >= 0)
+            delete_macro(j);
+        if ((m = n->after) == NULL)
+            continue;
+        newmacro(m->username, m->namelen, 0);
+        macros[nmacros].define_specs = m->define_specs;
+        if (m->define_specs != NULL)
+            shareSpecs(m->define_specs);
+        macros[nmacros].macrotext = my_strdup(m->macrotext);
+        macros[nmacros].macrolen = m->macrolen;
+        macros[nmacros].defined_in_comment = m->defined_in_comment;
+        macros[nmacros].nnamedargs = m->nnamedargs;
+        if (m->argnames != NULL) {
+            macros[nmacros].argnames = malloc(
+                    (m->nnamedargs + 1) * sizeof(char *));
+            if (macros[nmacros].argnames == NULL)
+                bug("Out of memory");
+            for (k = 0; k < m->nnamedargs; k++)
+                macros[nmacros].argnames[k] = my_strdup(m->argnames[k]);
+            macros[nmacros].argnames[k] = NULL;
+        }
+        macros[nmacros].body = m->body;
+        if (m->body != NULL)
+            m->body->refs++;
+        commit_macro();
+    }
+    if (R->outlen)
+        outstring(R->out, R->outlen);
+}
+
+/* the guard of the file E found, by its identity when it is known so
+   that other spellings of the path share it */
+static struct INCGUARD *includeGuard(const struct INCCACHE *E) {
+    struct INCGUARD *G;
+    int h;
+
+    if (E->known)
+        h = E->ino & (INCCACHE_SIZE - 1);
+    else
+        h = hashIdent(E->canon, strlen(E->canon)) & (INCCACHE_SIZE - 1);
+    for (G = incguards[h]; G != NULL; G = G->next)
+        if (E->known ? (G->known && (G->ino == E->ino) && (G->dev == E->dev))
+                : (!G->known && !strcmp(G->path, E->canon)))
+            return G;
+    G = malloc(sizeof *G);
+    if (G == NULL)
+        bug("Out of memory");
+    G->path = my_strdup(E->known ? E->path : E->canon);
+    G->known = E->known;
+    G->dev = E->dev;
+    G->ino = E->ino;
+    G->once = 0;
+    G->macro = G->out = NULL;
+    G->specs = NULL;
+    G->replay = NULL;
+    G->next = incguards[h];
+    incguards[h] = G;
+    return G;
+}
+
+void forgetGuard(struct INCGUARD *G) {
+    free(G->macro);
+    free(G->out);
+    releaseSpecs(G->specs);
+    G->macro = G->out = NULL;
+    G->specs = NULL;
+}
+
+void forgetGuards(void) {
+    struct INCGUARD *G;
+    int h;
+
+    for (h = 0; h < INCCACHE_SIZE; h++)
+        for (G = incguards[h]; G != NULL; G = G->next) {
+            forgetGuard(G);
+            G->once = 0;
+            freeReplay(G->replay);
+            G->replay = NULL;
+        }
+}
+
+/* including the file of G would leave no trace but G->out */
+int guardHolds(const struct INCGUARD *G) {
+    if (G->once)
+        return 1;
+    return (G->macro != NULL) && (include_directive_marker == NULL)
+            && ((G->specs == S) || ((G->specs->hash == S->hash)
+                    && sameSpecs(G->specs, S)))
+            && (findIdent(G->macro, strlen(G->macro)) >= 0);
+}
+
+void captureOutput(const char *s, int l) {
+    if (C->out != capture->ctx->out)
+        return;
+    if (capture->outlen + l > GUARD_OUT_MAX) {
+        capture->state = -1;
+        capture = NULL;
+        return;
+    }
+    memcpy(capture->out + capture->outlen, s, l);
+    capture->outlen += l;
+}
+
+/* #ifndef name at the level of the watched file */
+void watchIfndef(const char *name, int l) {
+    if ((watch->state != 0) || (C != watch->ctx))
+        return;
+    if ((iflevel != watch->level + 1) || (metacalls != watch->metas + 1)
+            || (macrocalls != watch->macros)) {
+        watch->state = -1;
+        capture = NULL;
+        return;
+    }
+    watch->state = 1;
+    watch->macro = malloc(l + 1);
+    if (watch->macro == NULL)
+        bug("Out of memory");
+    memcpy(watch->macro, name, l);
+    watch->macro[l] = 0;
+    capture = NULL;
+}
+
+void watchEndif(void) {
+    if ((watch->state == 1) && (C == watch->ctx)
+            && (iflevel == watch->level)) {
+        watch->state = 2;
+        watch->metas = metacalls;
+        watch->macros = macrocalls;
+        capture = watch;
+    }
+}
+
+/* keep what the watched file turned out to be */
+void endWatch(struct GUARDWATCH *W) {
+    int i;
 
+    if ((W->state == 2) && (metacalls == W->metas)
+            && (macrocalls == W->macros) && (iflevel == W->level)
+            && (execs == W->execs) && (include_directive_marker == NULL)) {
+        for (i = 0; (i < W->outlen) && isWhite(W->out[i]); i++)
+            ;
+        if (i == W->outlen) {
+            forgetGuard(W->G);
+            W->G->macro = W->macro;
+            W->G->specs = shareSpecs(W->specs);
+            W->G->out = malloc(W->outlen + 1);
+            if (W->G->out == NULL)
+                bug("Out of memory");
+            memcpy(W->G->out, W->out, W->outlen);
+            W->G->outlen = W->outlen;
+            return;
+        }
+    }
+    free(W->macro);
+}
+
+static void DoInclude(char *file_name, int ignore_nonexistent) {
+    struct INPUTCONTEXT *N;
+    struct ARENAMARK m;
+    struct INPUTFILE *f;
+    struct INCCACHE *E;
+    struct INCGUARD *G;
+    struct GUARDWATCH W, *outerwatch, *outercapture;
+    struct REPLAY *R;
+
+    E = includeEntry(file_name);
+    if (E->searched && (E->path != NULL)) {
+        G = includeGuard(E);
+        if (guardHolds(G)) {
+            inchits++;
+            guardskips++;
+            lastchar = EOF; /* as if it had been read to the end */
+            if (!G->once)
+                outstring(G->out, G->outlen);
+            replace_directive_with_blank_line(C->out->f);
+            return;
+        }
+        if ((G->replay != NULL) && replayHolds(G->replay, file_name)) {
+            inchits++;
+            replays++;
+            lastchar = EOF;
+            replayInclude(G->replay);
+            replace_directive_with_blank_line(C->out->f);
+            return;
+        }
+    }
+    f = openInclude(E, file_name);
     if (f == NULL) {
       if (ignore_nonexistent)
         return;
       else
         bug("Requested include file not found");
     }
+    G = includeGuard(E);
+    if (guardHolds(G)) { /* already seen under another name */
+        closeInput(f);
+        guardskips++;
+        lastchar = EOF;
+        if (!G->once)
+            outstring(G->out, G->outlen);
+        replace_directive_with_blank_line(C->out->f);
+        return;
+    }
+    W.G = G;
+    W.specs = S;
+    W.state = 0;
+    W.level = iflevel;
+    W.metas = metacalls;
+    W.macros = macrocalls;
+    W.execs = execs;
+    W.macro = NULL;
+    W.outlen = 0;
     
+    m = arenaMark();
     N = C;
-    C = malloc(sizeof *C);
+    C = arenaAlloc(sizeof *C);
     C->in = f;
-    C->argc = 0;
-    C->argv = NULL;
+    C->args = NULL;
     C->filename = file_name;
     C->out = N->out;
     C->lineno = 1;
-    C->bufsize = 80;
-    C->len = 0;
-    C->buf = C->malloced_buf = malloc(C->bufsize);
+    initInputBuf();
     C->eof = 0;
     C->namedargs = NULL;
     C->in_comment = 0;
     C->ambience = FLAG_TEXT;
     C->may_have_args = 0;
+    C->body = NULL;
+    W.ctx = C;
+    R = startRecording(E->path, file_name);
+    outerwatch = watch;
+    outercapture = capture;
+    watch = capture = &W;
     PushSpecs(S);
     if (autoswitch) {
         if (!strcmp(file_name + strlen(file_name) - 2, ".h")
                 || !strcmp(file_name + strlen(file_name) - 2, ".c"))
-            SetStandardMode(S, "C");
+            SetStandardMode(writableSpecs(specstack), "C");
+        specstack->specs = internSpecs(specstack->specs);
+        S = specstack->specs;
     }
+    if ((f->cached != NULL) && (f->cached->hits > 0))
+        f->segs = textSegments(f->cached, S);
 
     /* Include marker before the included contents */
     write_include_marker(N->out->f, 1, C->filename, "1");
     ProcessContext();
+    if (R != NULL)
+        endRecording(R, G);
+    capture = NULL;
+    endWatch(&W);
+    watch = outerwatch;
+    capture = outercapture;
     /* Include marker after the included contents */
     write_include_marker(N->out->f, N->lineno, N->filename, "2");
     /* Need to leave the blank line in lieu of #include, like cpp does */
     replace_directive_with_blank_line(N->out->f);
-    free(C);
     PopSpecs();
     C = N;
+    arenaRelease(m);
 }
 
 int ParsePossibleMeta(void) {
@@ -2417,9 +5133,10 @@ int ParsePossibleMeta(void) {
     int p1start, p1end, p2start, p2end, macend;
     int argc, argb[MAXARGS], arge[MAXARGS];
     char *tmpbuf;
+    struct ARENAMARK m;
 
     cklen = 1;
-    if (!matchStartSequence(S->Meta.mStart, &cklen))
+    if (!matchStartSequence(S->Meta.cStart, &cklen))
         return -1;
     nameend = identifierEnd(cklen);
     if (nameend && !getChar(nameend - 1))
@@ -2492,12 +5209,18 @@ int ParsePossibleMeta(void) {
     } else if (idequal(C->buf + cklen, nameend - cklen, "sinclude")) {
         id = 21;
         expparams = 1;
+    } else if (idequal(C->buf + cklen, nameend - cklen, "once")) {
+        id = 22;
+        expparams = 0;
     } else
         return -1;
+    metacalls++;
+    settleArgs(C->args, MAXARGS); /* they expand as they would have before */
 
     /* #MODE magic : define "..." to be C-style strings */
     if (id == 14) {
         PushSpecs(S);
+        writableSpecs(specstack);
         S->preservelf = 1;
         delete_comment(S, my_strdup("\""));
         add_comment(S, "sss", my_strdup("\""), my_strdup("\""), '\\', '\n');
@@ -2517,12 +5240,15 @@ int ParsePossibleMeta(void) {
     if (expparams && !nparam)
         bug("Missing argument in meta-macro");
 
+    m = arenaMark();
     switch (id) {
     case 1: /* DEFINE */
         if (!commented[iflevel]) {
             whiteout(&p1start, &p1end); /* recall comments are not allowed here */
             if ((p1start == p1end) || (identifierEnd(p1start) != p1end))
                 bug("#define requires an identifier (A-Z,a-z,0-9,_ only)");
+            if (recordings)
+                noteTouch(C->buf + p1start, p1end - p1start);
             /* buf starts 1 char before the macro */
             i = findIdent(C->buf + p1start, p1end - p1start);
             if (i >= 0)
@@ -2557,7 +5283,9 @@ int ParsePossibleMeta(void) {
                         arge[j] - argb[j]);
                 macros[nmacros].argnames[j][arge[j] - argb[j]] = 0;
             }
-            lookupArgRefs(nmacros++);
+            lookupArgRefs(nmacros);
+            compileBody(nmacros);
+            commit_macro();
         } else
             replace_directive_with_blank_line(C->out->f);
         break;
@@ -2570,6 +5298,8 @@ int ParsePossibleMeta(void) {
             whiteout(&p1start, &p1end);
             if ((p1start == p1end) || (identifierEnd(p1start) != p1end))
                 bug("#undef requires an identifier (A-Z,a-z,0-9,_ only)");
+            if (recordings)
+                noteTouch(C->buf + p1start, p1end - p1start);
             i = findIdent(C->buf + p1start, p1end - p1start);
             if (i >= 0)
                 delete_macro(i);
@@ -2608,6 +5338,8 @@ int ParsePossibleMeta(void) {
                 bug("#ifndef requires an identifier (A-Z,a-z,0-9,_ only)");
             i = findIdent(C->buf + p1start, p1end - p1start);
             commented[iflevel] = (i != -1);
+            if ((watch != NULL) && (nparam == 1))
+                watchIfndef(C->buf + p1start, p1end - p1start);
         }
         break;
 
@@ -2617,6 +5349,10 @@ int ParsePossibleMeta(void) {
             warning("Extra argument to #else ignored");
         if (iflevel == 0)
             bug("#else without #if");
+        if (recordings)
+            noteIfLevel();
+        if ((watch != NULL) && (iflevel == watch->level + 1))
+            watch->state = -1;
         if (!commented[iflevel - 1] && commented[iflevel] != 2)
             commented[iflevel] = !commented[iflevel];
         break;
@@ -2627,7 +5363,11 @@ int ParsePossibleMeta(void) {
             warning("Extra argument to #endif ignored");
         if (iflevel == 0)
             bug("#endif without #if");
+        if (recordings)
+            noteIfLevel();
         iflevel--;
+        if (watch != NULL)
+            watchEndif();
         break;
 
     case 7: /* INCLUDE */
@@ -2646,7 +5386,7 @@ int ParsePossibleMeta(void) {
             }
             if (p1start >= p1end)
                 bug("Missing file name in #include");
-            incfile_name = malloc(p1end - p1start + 1);
+            incfile_name = arenaAlloc(p1end - p1start + 1);
             /* extract the orig include filename */
             for (i = 0; i < p1end - p1start; i++)
                 incfile_name[i] = getChar(p1start + i);
@@ -2663,26 +5403,31 @@ int ParsePossibleMeta(void) {
                 warning(
                         "Not allowed to #exec. Command output will be left blank");
             else {
-                char *s, *t;
-                int c;
+                char *s, *t, *u;
+                char block[BUFSIZ];
+                size_t n;
                 FILE *f;
                 s = ProcessText(C->buf + p1start, p1end - p1start, FLAG_META);
                 if (nparam == 2) {
                     t = ProcessText(C->buf + p2start, p2end - p2start,
                             FLAG_META);
                     i = strlen(s);
-                    s = realloc(s, i + strlen(t) + 2);
-                    s[i] = ' ';
-                    strcpy(s + i + 1, t);
-                    free(t);
+                    u = arenaAlloc(i + strlen(t) + 2);
+                    memcpy(u, s, i);
+                    u[i] = ' ';
+                    strcpy(u + i + 1, t);
+                    s = u;
                 }
+                clearIncludeCache();
+                clearFileCache();
+                forgetGuards();
+                execs++;
                 f = popen(s, "r");
-                free(s);
                 if (f == NULL )
                     warning("Cannot #exec. Command not found(?)");
                 else {
-                    while ((c = fgetc(f)) != EOF)
-                        outchar((char) c);
+                    while ((n = fread(block, 1, sizeof block, f)) > 0)
+                        outstring(block, n);
                     pclose(f);
                 }
             }
@@ -2694,7 +5439,10 @@ int ParsePossibleMeta(void) {
             whiteout(&p1start, &p1end);
             if ((p1start == p1end) || (identifierEnd(p1start) != p1end))
                 bug("#defeval requires an identifier (A-Z,a-z,0-9,_ only)");
-            tmpbuf = ProcessText(C->buf + p2start, p2end - p2start, FLAG_META);
+            tmpbuf = my_strdup(
+                    ProcessText(C->buf + p2start, p2end - p2start, FLAG_META));
+            if (recordings)
+                noteTouch(C->buf + p1start, p1end - p1start);
             i = findIdent(C->buf + p1start, p1end - p1start);
             if (i >= 0)
                 delete_macro(i);
@@ -2727,7 +5475,9 @@ int ParsePossibleMeta(void) {
                         arge[j] - argb[j]);
                 macros[nmacros].argnames[j][arge[j] - argb[j]] = 0;
             }
-            lookupArgRefs(nmacros++);
+            lookupArgRefs(nmacros);
+            compileBody(nmacros);
+            commit_macro();
         } else
             replace_directive_with_blank_line(C->out->f);
         break;
@@ -2745,8 +5495,6 @@ int ParsePossibleMeta(void) {
             s = ProcessText(C->buf + p1start, p1end - p1start, FLAG_META);
             t = ProcessText(C->buf + p2start, p2end - p2start, FLAG_META);
             commented[iflevel] = (nowhite_strcmp(s, t) != 0);
-            free(s);
-            free(t);
         }
         break;
 
@@ -2763,8 +5511,6 @@ int ParsePossibleMeta(void) {
             s = ProcessText(C->buf + p1start, p1end - p1start, FLAG_META);
             t = ProcessText(C->buf + p2start, p2end - p2start, FLAG_META);
             commented[iflevel] = (nowhite_strcmp(s, t) == 0);
-            free(s);
-            free(t);
         }
         break;
 
@@ -2776,7 +5522,6 @@ int ParsePossibleMeta(void) {
             s = ArithmEval(p1start, p1end);
             for (t = s; *t; t++)
                 outchar(*t);
-            free(s);
         }
         break;
 
@@ -2787,12 +5532,9 @@ int ParsePossibleMeta(void) {
             bug("Too many nested #ifs");
         commented[iflevel] = commented[iflevel - 1];
         if (!commented[iflevel]) {
-            char *s;
             if (nparam == 2)
                 p1end = p2end; /* we really want it all ! */
-            s = ArithmEval(p1start, p1end);
-            commented[iflevel] = ((s[0] == '0') && (s[1] == 0));
-            free(s);
+            commented[iflevel] = !evalCondition(p1start, p1end);
         }
         break;
 
@@ -2822,17 +5564,18 @@ int ParsePossibleMeta(void) {
         replace_directive_with_blank_line(C->out->f);
         if (iflevel == 0)
             bug("#elif without #if");
+        if (recordings)
+            noteIfLevel();
+        if ((watch != NULL) && (iflevel == watch->level + 1))
+            watch->state = -1;
         if (!commented[iflevel - 1]) {
             if (commented[iflevel] != 1)
                 commented[iflevel] = 2;
             else {
-                char *s;
                 commented[iflevel] = 0;
                 if (nparam == 2)
                     p1end = p2end; /* we really want it all ! */
-                s = ArithmEval(p1start, p1end);
-                commented[iflevel] = ((s[0] == '0') && (s[1] == 0));
-                free(s);
+                commented[iflevel] = !evalCondition(p1start, p1end);
             }
         }
         break;
@@ -2853,7 +5596,6 @@ int ParsePossibleMeta(void) {
             s = ProcessText(C->buf + p1start,
                     (nparam == 2 ? p2end : p1end) - p1start, FLAG_META);
             warning(s);
-            free(s);
         }
         break;
 
@@ -2861,13 +5603,14 @@ int ParsePossibleMeta(void) {
         char buf[MAX_GPP_DATE_SIZE];
         char *fmt;
         time_t now = time(NULL );
+        if (recordings)
+            stopRecordings();
         fmt = ProcessText(C->buf + p1start,
                 (nparam == 2 ? p2end : p1end) - p1start, FLAG_META);
         if (!strftime(buf, MAX_GPP_DATE_SIZE, fmt, localtime(&now)))
             bug("date buffer exceeded");
         replace_directive_with_blank_line(C->out->f);
         sendout(buf, strlen(buf), 0);
-        free(fmt);
     }
         break;
 
@@ -2887,7 +5630,7 @@ int ParsePossibleMeta(void) {
             }
             if (p1start >= p1end)
                 bug("Missing file name in #sinclude");
-            incfile_name = malloc(p1end - p1start + 1);
+            incfile_name = arenaAlloc(p1end - p1start + 1);
             /* extract the orig include filename */
             for (i = 0; i < p1end - p1start; i++)
                 incfile_name[i] = getChar(p1start + i);
@@ -2898,49 +5641,109 @@ int ParsePossibleMeta(void) {
             replace_directive_with_blank_line(C->out->f);
         break;
 
+    case 22: /* ONCE */
+        replace_directive_with_blank_line(C->out->f);
+        if (!commented[iflevel] && (nparam > 0) && WarningLevel > 0)
+            warning("Extra argument to #once ignored");
+        if (!commented[iflevel] && (watch != NULL))
+            watch->G->once = 1;
+        if (!commented[iflevel] && recordings)
+            stopRecordings(); /* the file will not do it again */
+        break;
+
     default:
         bug("Internal meta-macro identification error");
     }
+    arenaRelease(m);
     shiftIn(macend);
     return 0;
 }
 
+/* argument i of A, expanded in the context of the call if not yet */
+char *expandArg(struct MACROARGS *A, int i) {
+    struct INPUTCONTEXT *T;
+    struct SPECSTACK *L;
+    struct ARENAMARK m;
+    char *s;
+
+    if (A->argv[i] == NULL) {
+        T = C;
+        L = specstack;
+        C = A->caller;
+        specstack = A->specs;
+        S = specstack->specs;
+        m = arenaMark();
+        s = ProcessText(C->buf + A->argb[i], A->arge[i] - A->argb[i],
+                FLAG_USER);
+        A->argl[i] = strlen(s);
+        A->argv[i] = my_strdup(s);
+        A->expanded[i] = 1;
+        arenaRelease(m);
+        C = T;
+        specstack = L;
+        S = L->specs;
+    }
+    return A->argv[i];
+}
+
+/* argument i of the macro being expanded.  Arguments are expanded in
+   the context of the call, but only when the body first uses them. */
+char *macroArg(int i) {
+    return expandArg(C->args, i);
+}
+
+/* expand the arguments of A below n that are still waiting, before
+   something that may change what they expand to */
+void settleArgs(struct MACROARGS *A, int n) {
+    int i;
+
+    if (A == NULL)
+        return;
+    for (i = 0; (i < n) && (i < A->argc); i++)
+        if (A->argv[i] == NULL)
+            expandArg(A, i);
+}
+
 int ParsePossibleUser(void) {
     int idstart, idend, sh_end, lg_end, macend;
-    int argc, id, i, l;
-    char *argv[MAXARGS];
-    int argb[MAXARGS], arge[MAXARGS];
+    int id, i, l;
+    struct MACROARGS A;
     struct INPUTCONTEXT *T;
+    struct MACROBODY *B;
+    struct ARENAMARK m;
 
     idstart = 1;
     id = 0;
-    if (!SplicePossibleUser(&idstart, &idend, &sh_end, &lg_end, argb, arge,
-            &argc, 1, &id, FLAG_USER))
+    if (!SplicePossibleUser(&idstart, &idend, &sh_end, &lg_end, A.argb,
+            A.arge, &A.argc, 1, &id, FLAG_USER))
         return -1;
     if ((sh_end >= 0) && (C->namedargs != NULL )) {
         i = findNamedArg(C->buf + idstart, idend - idstart);
         if (i >= 0) {
-            if (i < C->argc)
-                sendout(C->argv[i], strlen(C->argv[i]), 0);
+            if (i < C->args->argc) {
+                macroArg(i);
+                sendout(C->args->argv[i], C->args->argl[i], 0);
+            }
             shiftIn(sh_end);
             return 0;
         }
     }
 
-    if (id < 0)
+    if ((id < 0) && (id != DEFINED_OP))
         return -1;
+    macrocalls++;
     if (lg_end >= 0)
         macend = lg_end;
     else {
         macend = sh_end;
-        argc = 0;
+        A.argc = 0;
     }
 
-    if (macros[id].nnamedargs == -2) { /* defined(...) macro for arithmetic */
+    if (id == DEFINED_OP) {
         char *s, *t;
-        if (argc != 1)
+        if (A.argc != 1)
             return -1;
-        s = remove_comments(argb[0], arge[0], FLAG_USER);
+        s = remove_comments(A.argb[0], A.arge[0], FLAG_USER);
         t = s + strlen(s) - 1;
         if (*s != 0)
             while ((t != s) && isWhite(*t))
@@ -2960,47 +5763,88 @@ int ParsePossibleUser(void) {
         shiftIn(macend);
         return 0;
     }
-
-    for (i = 0; i < argc; i++)
-        argv[i] = ProcessText(C->buf + argb[i], arge[i] - argb[i], FLAG_USER);
+    if ((A.argc == 0) && isConstantBody(macros[id].body)) {
+        sendout(macros[id].body->text + 1, macros[id].body->len - 1, 0);
+        shiftIn(macend);
+        return 0;
+    }
+    if (!quietMacro(id))
+        settleArgs(C->args, MAXARGS);
+
+    m = arenaMark();
+    A.caller = C;
+    A.specs = specstack;
+    for (i = 0; i < A.argc; i++) {
+        /* arguments that expand to themselves are used in place, the
+           others wait for macroArg() unless they may run meta-macros,
+           whose side effects should still happen at the call and after
+           the arguments before them, or the call is in a false #if
+           branch, where they expand to nothing */
+        A.argl[i] = A.arge[i] - A.argb[i];
+        A.argv[i] = NULL;
+        A.expanded[i] = 0;
+        if (isInertText(C->buf + A.argb[i], A.argl[i]))
+            A.argv[i] = C->buf + A.argb[i];
+        else if (commented[iflevel]
+                || !quietText(C->buf + A.argb[i], A.argl[i])) {
+            settleArgs(&A, i);
+            A.argv[i] = ProcessText(C->buf + A.argb[i], A.argl[i], FLAG_USER);
+            A.argl[i] = strlen(A.argv[i]);
+        }
+    }
     /* process macro text */
     T = C;
-    C = malloc(sizeof *C);
+    C = arenaAlloc(sizeof *C);
     C->out = T->out;
     C->in = NULL;
-    C->argc = argc;
-    C->argv = argv;
+    C->args = &A;
     C->filename = T->filename;
     C->lineno = T->lineno;
     C->may_have_args = 1;
+    C->body = NULL;
+    B = NULL;
     if ((macros[id].nnamedargs == -1) && (lg_end >= 0)
             && (macros[id].define_specs->User.mEnd[0] == 0)) {
         /* build an aliased macro call */
         l = strlen(macros[id].macrotext) + 2
                 + strlen(macros[id].define_specs->User.mArgS)
                 + strlen(macros[id].define_specs->User.mArgE)
-                + (argc - 1) * strlen(macros[id].define_specs->User.mArgSep);
-        for (i = 0; i < argc; i++)
-            l += strlen(argv[i]);
-        C->buf = C->malloced_buf = malloc(l);
+                + (A.argc - 1) * strlen(macros[id].define_specs->User.mArgSep);
+        for (i = 0; i < A.argc; i++) {
+            macroArg(i);
+            l += A.argl[i];
+        }
+        C->buf = arenaAlloc(l);
         l = strlen(macros[id].macrotext) + 1;
         C->buf[0] = '\n';
         strcpy(C->buf + 1, macros[id].macrotext);
         while ((l > 1) && isWhite(C->buf[l - 1]))
             l--;
         strcpy(C->buf + l, macros[id].define_specs->User.mArgS);
-        for (i = 0; i < argc; i++) {
-            if (i > 0)
-                strcat(C->buf, macros[id].define_specs->User.mArgSep);
-            strcat(C->buf, argv[i]);
+        l += strlen(C->buf + l);
+        for (i = 0; i < A.argc; i++) {
+            if (i > 0) {
+                strcpy(C->buf + l, macros[id].define_specs->User.mArgSep);
+                l += strlen(C->buf + l);
+            }
+            memcpy(C->buf + l, A.argv[i], A.argl[i]);
+            l += A.argl[i];
         }
-        strcat(C->buf, macros[id].define_specs->User.mArgE);
+        strcpy(C->buf + l, macros[id].define_specs->User.mArgE);
         C->may_have_args = 0;
+    } else if (macros[id].body != NULL) {
+        B = macros[id].body;
+        B->refs++;
+        C->buf = B->text;
+        C->body = B;
+        C->bodyseg = 0;
+        C->bodymodes = modechanges;
     } else {
-        C->buf = C->malloced_buf = malloc(strlen(macros[id].macrotext) + 2);
+        C->buf = arenaAlloc(macros[id].macrolen + 2);
         C->buf[0] = '\n';
         strcpy(C->buf + 1, macros[id].macrotext);
     }
+    C->malloced_buf = NULL;
     C->len = strlen(C->buf);
     C->bufsize = C->len + 1;
     C->eof = 0;
@@ -3010,32 +5854,50 @@ int ParsePossibleUser(void) {
     PushSpecs(macros[id].define_specs);
     ProcessContext();
     PopSpecs();
-    free(C);
     C = T;
-
-    for (i = 0; i < argc; i++)
-        free(argv[i]);
+    releaseBody(B);
+    for (i = 0; i < A.argc; i++)
+        if (A.expanded[i])
+            free(A.argv[i]);
+    arenaRelease(m);
     shiftIn(macend);
     return 0;
 }
 
 void ParseText(void) {
-    int l, cs, ce;
+    int l, cs, ce, k;
+    unsigned int mask;
     char c, *s;
     struct COMMENT *p;
+    struct ARENAMARK m;
 
     if (++parselevel == STACKDEPTH)
       bug("Stack depth exceeded during parse");
 
+    if ((C->body != NULL) && ParseBody()) {
+        parselevel--;
+        return;
+    }
+
+    /* copy plain text up to the next thing to look at in one go */
+    l = plainTextEnd();
+    if (l > 1) {
+        sendout(C->buf + 1, l - 1, 1);
+        shiftIn(l);
+        parselevel--;
+        return;
+    }
+
     /* look for comments first */
     if (!C->in_comment) {
         cs = 1;
-        for (p = S->comments; p != NULL ; p = p->next)
-            if (!(p->flags[C->ambience] & FLAG_IGNORE))
-                if (matchStartSequence(p->start, &cs)) {
-                    l = ce = findCommentEnd(p->end, p->quote, p->warn, cs,
+        mask = commentCandidates(1);
+        for (p = S->comments, k = 0; mask && (p != NULL); p = p->next, k++)
+            if ((mask & COMMENT_BIT(k)) && !(p->flags[C->ambience] & FLAG_IGNORE))
+                if (matchStartSequence(p->cstart, &cs)) {
+                    l = ce = findCommentEnd(p->cend, p->quote, p->warn, cs,
                             p->flags[C->ambience]);
-                    matchEndSequence(p->end, &l);
+                    matchEndSequence(p->cend, &l);
                     if (p->flags[C->ambience] & OUTPUT_DELIM)
                         sendout(C->buf + 1, cs - 1, 0);
                     if (!(p->flags[C->ambience] & OUTPUT_TEXT))
@@ -3043,11 +5905,12 @@ void ParseText(void) {
                                 C->buf + ce - 1, 0);
                     if (p->flags[C->ambience] & PARSE_MACROS) {
                         C->in_comment = 1;
+                        m = arenaMark();
                         s = ProcessText(C->buf + cs, ce - cs, C->ambience);
                         if (p->flags[C->ambience] & OUTPUT_TEXT)
                             sendout(s, strlen(s), 0);
                         C->in_comment = 0;
-                        free(s);
+                        arenaRelease(m);
                     } else if (p->flags[C->ambience] & OUTPUT_TEXT)
                         sendout(C->buf + cs, ce - cs, 0);
                     if (p->flags[C->ambience] & OUTPUT_DELIM)
@@ -3069,13 +5932,15 @@ void ParseText(void) {
 
     l = 1;
     /* If matching numbered macro argument and inside a macro */
-    if (matchSequence(S->User.mArgRef, &l) && C->may_have_args) {
+    if (matchSequence(S->User.cArgRef, &l) && C->may_have_args) {
         /* Process macro arguments referenced as #1,#2,... */
         c = getChar(l);
         if ((c >= '1') && (c <= '9')) {
             c = c - '1';
-            if (c < C->argc)
-                sendout(C->argv[(int) c], strlen(C->argv[(int) c]), 0);
+            if ((C->args != NULL) && (c < C->args->argc)) {
+                macroArg(c);
+                sendout(C->args->argv[(int) c], C->args->argl[(int) c], 0);
+            }
             shiftIn(l + 1);
 	    parselevel--;
             return;
@@ -3098,7 +5963,7 @@ void ProcessContext(void) {
     while (!C->eof)
         ParseText();
     if (C->in != NULL )
-        fclose(C->in);
+        closeInput(C->in);
     free(C->malloced_buf);
 }
 
@@ -3122,19 +5987,25 @@ static void getDirname(const char *fname, char *dirname) {
     dirname[i + 1] = '\0';
 }
 
-static FILE *openInCurrentDir(const char *incfile) {
-    FILE *f;
+static struct INPUTFILE *openInCurrentDir(const char *incfile, char **path) {
+    struct INPUTFILE *f;
     char *absfile;
 
     if (IncludeFile) {
-      return fopen(incfile, "r");
+      f = openIncluded(incfile);
+      if (f != NULL)
+        *path = my_strdup(incfile);
+      return f;
     }
 
     absfile = calloc(strlen(C->filename) + strlen(incfile) + 1, 1);
     getDirname(C->filename, absfile);
     strcat(absfile, incfile);
-    f = fopen(absfile, "r");
-    free(absfile);
+    f = openIncluded(absfile);
+    if (f != NULL)
+        *path = absfile;
+    else
+        free(absfile);
     return f;
 }
 
@@ -3144,7 +6015,7 @@ void replace_definition_with_blank_lines(const char *start, const char *end,
     if ((include_directive_marker != NULL )&& (C->out->f != NULL)){
     while (start <= end) {
         if (*start == '\n') {
-            if (skip) skip--; else fprintf(C->out->f,"\n");
+            if (skip) skip--; else writeOutputRaw(C->out->f,"\n",1);
         }
         start++;
     }
@@ -3154,18 +6025,21 @@ void replace_definition_with_blank_lines(const char *start, const char *end,
     /* insert blank line where the metas IFDEF,ELSE,INCLUDE, etc., stood in the
      input text
      */
-void replace_directive_with_blank_line(FILE *f) {
+void replace_directive_with_blank_line(struct OUTPUTFILE *f) {
     if ((include_directive_marker != NULL )&& (f != NULL)
     && (!S->preservelf) && (S->Meta.mArgE[0]=='\n')){
-    fprintf(f,"\n");
+    writeOutputRaw(f,"\n",1);
 }
 }
 
     /* If lineno is > 15 digits - the number won't be printed correctly */
-void write_include_marker(FILE *f, int lineno, char *filename,
+void write_include_marker(struct OUTPUTFILE *f, int lineno, char *filename,
         const char *marker) {
     static char lineno_buf[MAX_GPP_NUM_SIZE];
     static char *escapedfilename = NULL;
+    static char *markerbuf = NULL;
+    static int markersize = 0;
+    int l;
 
     if ((include_directive_marker != NULL )&& (f != NULL)){
 #ifdef WIN_NT
@@ -3174,7 +6048,17 @@ void write_include_marker(FILE *f, int lineno, char *filename,
             escapedfilename = filename;
 #endif
             sprintf(lineno_buf,"%d", lineno);
-            fprintf(f, include_directive_marker, lineno_buf, escapedfilename, marker);
+            l = snprintf(markerbuf, markersize, include_directive_marker,
+                    lineno_buf, escapedfilename, marker);
+            if (l >= markersize) {
+                markersize = l + 1;
+                markerbuf = realloc(markerbuf, markersize);
+                if (markerbuf == NULL )
+                    bug("Out of memory");
+                snprintf(markerbuf, markersize, include_directive_marker,
+                        lineno_buf, escapedfilename, marker);
+            }
+            writeOutputRaw(f, markerbuf, l);
         }
     }
 
@@ -3253,6 +6137,19 @@ void construct_include_directive_marker(char **include_directive_marker,
     *(*include_directive_marker + out_idx) = '\0';
 }
 
+void printStats(void) {
+    fprintf(stderr, "gpp: #if cache: %lu hits, %lu misses\n", ifhits,
+            ifmisses);
+    fprintf(stderr, "gpp: include lookups: %lu hits, %lu misses\n", inchits,
+            incmisses);
+    fprintf(stderr, "gpp: guarded includes skipped: %lu\n", guardskips);
+    fprintf(stderr, "gpp: include contents: %lu hits, %lu misses\n",
+            filehits, filemisses);
+    fprintf(stderr, "gpp: includes replayed: %lu\n", replays);
+    fprintf(stderr, "gpp: include scans: %lu built, %lu reused\n", segbuilds,
+            segreuses);
+}
+
 int main(int argc, char **argv) {
     initthings(argc, argv);
     /* The include marker at the top of the file */
@@ -3261,7 +6158,10 @@ int main(int argc, char **argv) {
     IncludeFile = NULL;
     write_include_marker(C->out->f, 1, C->filename, "");
     ProcessContext();
-    fclose(C->out->f);
+    closeOutput(C->out->f);
+    mainoutput = NULL;
+    if (showstats)
+        printStats();
     return EXIT_SUCCESS;
 }
 